@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+
+# Scaling study driver. Runs every combination of simulator, scene, rank
+# count, -lb and thread count --repeats times with -profile, then prints the
+# median / stddev of the total simulation time and of every profiled phase
+# (its max over ranks), the parallel efficiency against the smallest rank
+# count of the sweep, and optionally writes all of it as CSV and JSON.
+#
+# Usage: ./scaling.py [--versions v1,v2] [--ranks 1,2,3,4,6,8] [--lb 0,1]
+#                     [--threads 1] [--repeats 3] [--scenes a,b,...] [--weak]
+#                     [--csv out.csv] [--json out.json] [--check]
+#
+# Scenes are the names in src/benchmark-files or generated ones written as
+# <distribution>-<N>, e.g. uniform-400000, see scene_gen.py. With --weak the
+# particle count of generated scenes grows with the number of workers
+# (ranks * threads), and the efficiency is T(base) / T(workers).
+
+import argparse
+import csv
+import json
+import os
+import re
+import statistics
+import subprocess
+
+import scene_gen
+
+BENCHMARK_DIR = 'src/benchmark-files'
+SCENE_DIR = 'logs/scenes'
+
+# name: (N, space size, iterations), as in checker.py
+BENCHMARK_SCENES = {
+    'random-50000': (50000, 500.0, 5),
+    'corner-50000': (50000, 500.0, 5),
+    'repeat-10000': (10000, 100.0, 50),
+    'sparse-50000': (50000, 5.0, 50),
+    'sparse-200000': (200000, 20.0, 50),
+}
+
+
+def resolve_scene(name, workers, base_workers, weak):
+    """Returns (label, N, init file, ref file or None, space size, iterations)."""
+    if name in BENCHMARK_SCENES:
+        assert not weak, f'ERROR -- {name} has a fixed size, use a generated scene'
+        n, size, its = BENCHMARK_SCENES[name]
+        ref = f'{BENCHMARK_DIR}/{name}-ref.txt'
+        return name, n, f'{BENCHMARK_DIR}/{name}-init.txt', ref, size, its
+    distribution, n = name.rsplit('-', 1)
+    assert distribution in scene_gen.FAMILIES, f'ERROR -- unknown scene {name}'
+    n = int(n) * workers // base_workers if weak else int(n)
+    init = f'{SCENE_DIR}/{distribution}-{n}.bin'
+    if not os.path.exists(init):
+        os.makedirs(SCENE_DIR, exist_ok=True)
+        scene_gen.save(init, scene_gen.generate(distribution, n))
+    return (name, n, init, None, scene_gen.space_size(distribution, n),
+            scene_gen.iterations(distribution))
+
+
+def compare(actual, ref):
+    # same tolerances as checker.py
+    threshold = 1.0 if 'repeat' in ref else 0.1
+    actual = open(actual).readlines()
+    ref = open(ref).readlines()
+    assert len(actual) == len(ref), f'ERROR -- wrong particle count in {actual}'
+    for i, (l1, l2) in enumerate(zip(actual, ref)):
+        assert all(abs(float(x) - float(y)) < threshold
+                   for x, y in zip(l1.split(), l2.split())), \
+            f'ERROR -- incorrect result at line {i}'
+
+
+def parse_log(text):
+    """Returns (total time, {profile row: (mean, max)})."""
+    total = float(re.findall(r'total simulation time: (.*?)s', text)[0])
+    profile = {}
+    rows = text.split('profile', 1)[1].splitlines()[1:] if 'profile' in text else []
+    for line in rows:
+        fields = line.split()
+        if len(fields) == 5:
+            profile[fields[0]] = (float(fields[2]), float(fields[3]))
+    return total, profile
+
+
+def run(args, version, ranks, threads, lb, scene):
+    label, n, init, ref, size, its = scene
+    output = f'logs/{label}-{version}-{ranks}.txt'
+    cmd = args.mpirun.split() + ['-n', str(ranks), f'./nbody-release-{version}',
+                                 '-n', str(n), '-i', str(its), '-in', init,
+                                 '-s', str(size), '-o', output, '-profile',
+                                 '-t', str(threads)]
+    if lb:
+        cmd.append('-lb')
+    result = subprocess.run(cmd, stdout=subprocess.PIPE, universal_newlines=True)
+    assert result.returncode == 0, f'ERROR -- {" ".join(cmd)} failed'
+    if args.check and ref:
+        compare(output, ref)
+    return parse_log(result.stdout)
+
+
+def summarize(samples):
+    median = statistics.median(samples)
+    stddev = statistics.stdev(samples) if len(samples) > 1 else 0.0
+    return median, stddev
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    ints = lambda s: [int(x) for x in s.split(',')]
+    parser.add_argument('--versions', default='v1,v2', type=lambda s: s.split(','))
+    parser.add_argument('--ranks', default='1,2,3,4,6,8', type=ints)
+    parser.add_argument('--lb', default='0', type=ints)
+    parser.add_argument('--threads', default='1', type=ints)
+    parser.add_argument('--repeats', default=3, type=int)
+    parser.add_argument('--scenes', default=','.join(BENCHMARK_SCENES),
+                        type=lambda s: s.split(','))
+    parser.add_argument('--weak', action='store_true')
+    parser.add_argument('--mpirun', default='mpirun --oversubscribe')
+    parser.add_argument('--csv')
+    parser.add_argument('--json')
+    parser.add_argument('--check', action='store_true',
+                        help='compare benchmark scenes against their reference')
+    args = parser.parse_args()
+    os.makedirs('logs', exist_ok=True)
+
+    base_workers = min(args.ranks) * min(args.threads)
+    results = []
+    for version in args.versions:
+        for name in args.scenes:
+            for lb in args.lb:
+                for threads in args.threads:
+                    base_time = None
+                    for ranks in sorted(args.ranks):
+                        workers = ranks * threads
+                        scene = resolve_scene(name, workers, base_workers,
+                                              args.weak)
+                        print(f'--- {version} {name} n={scene[1]} ranks={ranks} '
+                              f'threads={threads} lb={lb} ---', flush=True)
+                        runs = [run(args, version, ranks, threads, lb, scene)
+                                for _ in range(args.repeats)]
+                        median, stddev = summarize([t for t, _ in runs])
+                        if base_time is None:
+                            base_time, base = median, workers
+                        if args.weak:
+                            efficiency = base_time / median
+                        else:
+                            efficiency = base_time * base / (median * workers)
+                        row = {'version': version, 'scene': name,
+                               'particles': scene[1], 'ranks': ranks,
+                               'threads': threads, 'lb': lb,
+                               'repeats': args.repeats, 'time_median': median,
+                               'time_stddev': stddev, 'efficiency': efficiency}
+                        for key in runs[0][1]:
+                            m, s = summarize([p[key][1] for _, p in runs])
+                            row[f'{key}_max_median'] = m
+                            row[f'{key}_max_stddev'] = s
+                            row[f'{key}_imbalance'] = statistics.median(
+                                p[key][1] / p[key][0] if p[key][0] else 1.0
+                                for _, p in runs)
+                        results.append(row)
+                        print(f'time {median:.6f}s +- {stddev:.6f}s, '
+                              f'efficiency {efficiency:.3f}', flush=True)
+
+    columns = []
+    for row in results:
+        columns += [k for k in row if k not in columns]
+    print('\n-- Scaling Table ---')
+    short = ['version', 'scene', 'particles', 'ranks', 'threads', 'lb',
+             'time_median', 'time_stddev', 'efficiency']
+    print('|'.join(f' {x:<13} ' for x in short))
+    for row in results:
+        print('|'.join(f' {row[k]:<13.6g} ' if isinstance(row[k], float)
+                       else f' {row[k]:<13} ' for k in short))
+    if args.csv:
+        with open(args.csv, 'w', newline='') as f:
+            writer = csv.DictWriter(f, fieldnames=columns)
+            writer.writeheader()
+            writer.writerows(results)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+
+# Benchmark scene generator, for any particle count.
+#
+# Usage: ./scene_gen.py <distribution> <N> <output> [seed]
+#   distribution: uniform, corner, sparse or repeat
+#   output: text like src/benchmark-files, or the binary format of
+#           src/particle-io.h if the name ends in .bin
+#
+# The families follow the scenes in src/benchmark-files: masses in [1, 10),
+# positions in [-L, L]^2 and velocities in [-L/2, L/2]^2. "corner" moves
+# about half of the particles into the top right quadrant, "sparse" spreads
+# them over L = 100 * space size. Space sizes grow with sqrt(N) so the
+# particle density stays that of the 50000 (10000 for repeat) particle scene.
+
+import math
+import random
+import struct
+import sys
+
+# distribution: (reference N, reference space size, iterations)
+FAMILIES = {
+    'uniform': (50000, 500.0, 5),
+    'corner': (50000, 500.0, 5),
+    'sparse': (50000, 5.0, 50),
+    'repeat': (10000, 100.0, 50),
+}
+CORNER_FRACTION = 0.55
+
+
+def space_size(distribution, n):
+    ref_n, ref_size, _ = FAMILIES[distribution]
+    return ref_size * math.sqrt(n / ref_n)
+
+
+def iterations(distribution):
+    return FAMILIES[distribution][2]
+
+
+def extent(distribution, size):
+    return 100.0 * size if distribution == 'sparse' else size
+
+
+def generate(distribution, n, seed=0):
+    """Returns n (mass, x, y, vx, vy) tuples."""
+    rng = random.Random(seed)
+    size = space_size(distribution, n)
+    l = extent(distribution, size)
+    particles = []
+    for _ in range(n):
+        mass = rng.uniform(1.0, 10.0)
+        x = rng.uniform(-l, l)
+        y = rng.uniform(-l, l)
+        vx = rng.uniform(-l / 2, l / 2)
+        vy = rng.uniform(-l / 2, l / 2)
+        if distribution == 'corner' and rng.random() < CORNER_FRACTION:
+            x, y = (x + l) / 2, (y + l) / 2
+        particles.append((mass, x, y, vx, vy))
+    return particles
+
+
+def save(file_name, particles):
+    if file_name.endswith('.bin'):
+        with open(file_name, 'wb') as f:
+            f.write(struct.pack('<4sIQ', b'NBPF', 1, len(particles)))
+            f.write(b''.join(struct.pack('<5f', *p) for p in particles))
+    else:
+        with open(file_name, 'w') as f:
+            f.writelines('%.9g %.9g %.9g %.9g %.9g\n' % p for p in particles)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) not in (4, 5) or sys.argv[1] not in FAMILIES:
+        sys.exit(f'usage: {sys.argv[0]} {"|".join(FAMILIES)} <N> <output> [seed]')
+    distribution, n, output = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+    seed = int(sys.argv[4]) if len(sys.argv) == 5 else 0
+    save(output, generate(distribution, n, seed))
+    print(f'{output}: {n} particles, -s {space_size(distribution, n):g} '
+          f'-i {iterations(distribution)}')
@@ -0,0 +1,37 @@
+#ifndef ALLOC_COUNTER_H
+#define ALLOC_COUNTER_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Counts the program's heap allocations by replacing the global operator
+// new. The replacements are not inline, so include this header from exactly
+// one translation unit of a program (the simulators and tools are one each).
+// GCC must not inline them either: it then pairs their malloc and free with
+// the caller's new and delete and warns about a mismatch.
+#define ALLOC_COUNTER_NOINLINE __attribute__((noinline))
+
+std::atomic<long long> heapAllocationCount{0};
+
+inline long long heapAllocations() { return heapAllocationCount.load(); }
+
+ALLOC_COUNTER_NOINLINE void *operator new(size_t size) {
+  heapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+ALLOC_COUNTER_NOINLINE void *operator new[](size_t size) {
+  return operator new(size);
+}
+ALLOC_COUNTER_NOINLINE void operator delete(void *p) noexcept { free(p); }
+ALLOC_COUNTER_NOINLINE void operator delete[](void *p) noexcept { free(p); }
+ALLOC_COUNTER_NOINLINE void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+ALLOC_COUNTER_NOINLINE void operator delete[](void *p, size_t) noexcept {
+  free(p);
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Headroom for the buffers whose sizes change from step to step (local and
+// ghost particle counts, tree sizes): a buffer that has to grow gets this
+// much more than asked for, so once the sizes settle none of them
+// reallocates.
+const float BufferSlack = 1.25f;
+
+// Makes room for n elements in v, with headroom if it has to grow.
+template <typename T>
+inline void reserveWithSlack(std::vector<T> &v, size_t n) {
+  if (v.capacity() < n)
+    v.reserve((size_t)(n * BufferSlack));
+}
+
+// Bump allocator for one rank's per-iteration scratch arrays: allocate()
+// hands out aligned slices of one block and reset() releases all of them at
+// once. Requests that do not fit get blocks of their own until the next
+// reset(), which replaces the block by one that holds the whole last
+// iteration with BufferSlack headroom, so the steady state does not touch
+// the heap. Nothing is constructed or destroyed; only the calling thread
+// may allocate.
+class Arena {
+public:
+  static const size_t Alignment = 64;
+
+  // n uninitialized elements, valid until the next reset()
+  template <typename T> T *allocate(size_t n) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena memory is never destroyed");
+    const size_t bytes = (n * sizeof(T) + Alignment - 1) & ~(Alignment - 1);
+    used += bytes;
+    if (offset + bytes <= capacity) {
+      char *p = base + offset;
+      offset += bytes;
+      return reinterpret_cast<T *>(p);
+    }
+    overflow.emplace_back(new char[bytes + Alignment]);
+    return reinterpret_cast<T *>(align(overflow.back().get()));
+  }
+
+  // Releases everything allocated since the last reset().
+  void reset() {
+    if (!overflow.empty()) {
+      overflow.clear();
+      capacity = (size_t)(used * BufferSlack);
+      capacity = (capacity + Alignment - 1) & ~(Alignment - 1);
+      block.reset(new char[capacity + Alignment]);
+      base = align(block.get());
+    }
+    offset = 0;
+    used = 0;
+  }
+
+private:
+  std::unique_ptr<char[]> block;
+  char *base = nullptr;
+  size_t capacity = 0, offset = 0;
+  // bytes requested since the last reset(), in or out of the block
+  size_t used = 0;
+  std::vector<std::unique_ptr<char[]>> overflow;
+
+  static char *align(char *p) {
+    return reinterpret_cast<char *>(
+        (reinterpret_cast<uintptr_t>(p) + Alignment - 1) & ~(Alignment - 1));
+  }
+};
+
+#endif
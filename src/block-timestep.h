@@ -0,0 +1,91 @@
+#ifndef BLOCK_TIMESTEP_H
+#define BLOCK_TIMESTEP_H
+
+#include "common.h"
+#include <cstdint>
+
+// -timestep-levels L: hierarchical block timesteps. Steps are grouped into
+// blocks of 2^L steps of deltaTime, and every particle has a level k in
+// [0, L]: it steps by the block time / 2^k, so it is active (needs a force)
+// only every 2^(L - k) steps, at the steps i with i % 2^(L - k) == 0. An
+// active particle gets its force from the current positions of all
+// particles, picks its level from its acceleration and speed, and is kicked
+// by its own step; every particle drifts by deltaTime every step, so the
+// positions of all particles are current after every step. Particles at
+// level L step exactly like updateParticle, the global step is the finest.
+//
+// The level is the coarsest one at which, over one step dt of the particle,
+// - the displacement due to its acceleration, |a| dt^2 / 2, and
+// - the distance by which any particle can approach it, (|v| + maxSpeed) dt
+// stay within accuracy * cullRadius. The second bound keeps particles that
+// feel no force now from missing an encounter: particles entering the cull
+// radius between two kicks get no further than accuracy * cullRadius into
+// it, which is within computeForce's decay band for accuracy <= 0.25. A
+// particle only moves to a coarser level at a step on that level's grid, so
+// its steps always end at block boundaries.
+
+const int MaxTimestepLevel = 16;
+
+class BlockTimesteps {
+public:
+  BlockTimesteps(int maxLevel, float accuracy)
+      : maxLevel(std::min(std::max(maxLevel, 0), MaxTimestepLevel)),
+        accuracy(accuracy) {}
+
+  bool isEnabled() const { return maxLevel > 0; }
+
+  // n particles, all at the finest level, which is active at every step
+  void resize(size_t n) { level.assign(n, (uint8_t)maxLevel); }
+
+  // steps between the kicks of particle j
+  int period(size_t j) const { return 1 << (maxLevel - level[j]); }
+
+  // Replaces active by the indices in [0, n) of the particles active at
+  // step i.
+  void collectActive(int i, std::vector<int> &active) const {
+    active.clear();
+    for (size_t j = 0; j < level.size(); j++)
+      if (i % period(j) == 0)
+        active.push_back((int)j);
+  }
+
+  // Particle j (state p), active at step i, picks its level from force and
+  // returns p with the velocity kicked by its step. maxSpeed bounds the
+  // speed of every particle. Safe to call for different j concurrently.
+  Particle kick(size_t j, const Particle &p, Vec2 force, int i,
+                const StepParameters &params, float maxSpeed) {
+    const float blockTime = params.deltaTime * (float)(1 << maxLevel);
+    // coarsest level whose grid contains i
+    int coarsest = 0;
+    while (coarsest < maxLevel && i % (1 << (maxLevel - coarsest)) != 0)
+      coarsest++;
+    const float reach = accuracy * params.cullRadius;
+    const int k = std::max(
+        requiredLevel(p, force, blockTime, reach, maxSpeed), coarsest);
+    level[j] = (uint8_t)k;
+    Particle result = p;
+    const float dt = blockTime / (float)(1 << k);
+    result.velocity += force * (dt / p.mass);
+    return result;
+  }
+
+private:
+  int maxLevel;
+  float accuracy;
+  std::vector<uint8_t> level;
+
+  int requiredLevel(const Particle &p, Vec2 force, float blockTime,
+                    float reach, float maxSpeed) const {
+    const float a = force.length() / p.mass;
+    const float v = p.velocity.length() + maxSpeed;
+    int k = 0;
+    for (; k < maxLevel; k++) {
+      const float dt = blockTime / (float)(1 << k);
+      if (0.5f * a * dt * dt <= reach && v * dt <= reach)
+        break;
+    }
+    return k;
+  }
+};
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef CELL_GRID_H
+#define CELL_GRID_H
+
+#include "common.h"
+#include "quad-tree.h"
+#include <algorithm>
+#include <string>
+
+// Uniform grid of square cells over the particles' bounds, an alternative to
+// QuadTree for evenly spread particles. The particles are counting sorted by
+// cell in row-major order, so the cells one row of a query touches are one
+// contiguous range of cellParticles and of the SoA arrays.
+class CellGrid {
+public:
+  // the cell size grows until the grid has at most this many cells per
+  // particle, which bounds the memory and the build passes for sparse inputs
+  static const int MaxCellsPerParticle = 16;
+
+  Vec2 bmin, bmax;
+  float cellSize = 1.0f;
+  int nx = 0, ny = 0;
+  // particles of cell c = iy * nx + ix are [cellStart[c], cellStart[c + 1])
+  std::vector<int> cellStart;
+  std::vector<Particle> cellParticles;
+  // positions and masses of cellParticles, padded by QuadTreeSoAPadding
+  // zeros like QuadTree's
+  std::vector<float> cellX, cellY, cellMass;
+
+  // Same contract as QuadTree::getParticles.
+  void getParticles(std::vector<Particle> &particles, Vec2 position,
+                    float radius) const {
+    particles.clear();
+    forEachRange(position, radius, [&](int begin, int end) {
+      for (int i = begin; i < end; i++)
+        if ((position - cellParticles[i].position).length() < radius)
+          particles.push_back(cellParticles[i]);
+    });
+  }
+
+  // Calls f(begin, end) for ranges of cellParticles that together hold every
+  // particle within radius of position: one range per row of cells, cut to
+  // the cells the disk overlaps in that row.
+  template <typename F>
+  void forEachRange(Vec2 position, float radius, F &&f) const {
+    if (cellParticles.empty())
+      return;
+    int iy0 = std::max(cellCoord(position.y - radius, bmin.y), 0);
+    int iy1 = std::min(cellCoord(position.y + radius, bmin.y), ny - 1);
+    for (int iy = iy0; iy <= iy1; iy++) {
+      // half width of the disk over the part of this row closest to it; the
+      // row is widened a little so rounding cannot drop a boundary particle
+      float rowLo = bmin.y + iy * cellSize, rowHi = rowLo + cellSize;
+      float dy = fmaxf(fmaxf(rowLo - position.y, position.y - rowHi), 0.0f);
+      dy = fmaxf(dy - cellSize * 1e-3f, 0.0f);
+      float half = sqrtf(fmaxf(radius * radius - dy * dy, 0.0f));
+      int ix0 = std::max(cellCoord(position.x - half, bmin.x), 0);
+      int ix1 = std::min(cellCoord(position.x + half, bmin.x), nx - 1);
+      if (ix0 > ix1)
+        continue;
+      int begin = cellStart[iy * nx + ix0], end = cellStart[iy * nx + ix1 + 1];
+      if (begin < end)
+        f(begin, end);
+    }
+  }
+
+  // Builds the grid with cells of about cellSize (larger if the grid would
+  // exceed MaxCellsPerParticle). Reusing the same CellGrid across iterations
+  // reuses its buffers.
+  static void build(const std::vector<Particle> &particles, CellGrid &grid,
+                    float cellSize) {
+    grid.bmin = Vec2(1e30f, 1e30f);
+    grid.bmax = Vec2(-1e30f, -1e30f);
+    for (auto &p : particles) {
+      grid.bmin.x = fminf(grid.bmin.x, p.position.x);
+      grid.bmin.y = fminf(grid.bmin.y, p.position.y);
+      grid.bmax.x = fmaxf(grid.bmax.x, p.position.x);
+      grid.bmax.y = fmaxf(grid.bmax.y, p.position.y);
+    }
+    Vec2 extent = grid.bmax - grid.bmin;
+    const double maxCells =
+        (double)MaxCellsPerParticle * std::max(particles.size(), (size_t)1);
+    while ((double)gridCells(extent.x, cellSize) *
+               gridCells(extent.y, cellSize) >
+           maxCells)
+      cellSize *= 2.0f;
+    grid.cellSize = cellSize;
+    grid.nx = particles.empty() ? 0 : gridCells(extent.x, cellSize);
+    grid.ny = particles.empty() ? 0 : gridCells(extent.y, cellSize);
+
+    const int numCells = grid.nx * grid.ny;
+    reserveWithSlack(grid.cellOf, particles.size());
+    reserveWithSlack(grid.cellParticles, particles.size());
+    reserveWithSlack(grid.cellStart, numCells + 1);
+    reserveWithSlack(grid.offsets, numCells);
+    grid.cellOf.resize(particles.size());
+    grid.cellStart.assign(numCells + 1, 0);
+    for (size_t i = 0; i < particles.size(); i++) {
+      int c = grid.cellIndex(particles[i].position);
+      grid.cellOf[i] = c;
+      grid.cellStart[c + 1]++;
+    }
+    for (int c = 0; c < numCells; c++)
+      grid.cellStart[c + 1] += grid.cellStart[c];
+
+    // stable scatter, offsets start at each cell's begin
+    grid.offsets.assign(grid.cellStart.begin(), grid.cellStart.end() - 1);
+    grid.cellParticles.resize(particles.size());
+    for (size_t i = 0; i < particles.size(); i++)
+      grid.cellParticles[grid.offsets[grid.cellOf[i]]++] = particles[i];
+
+    const size_t n = particles.size();
+    reserveWithSlack(grid.cellX, n + QuadTreeSoAPadding);
+    reserveWithSlack(grid.cellY, n + QuadTreeSoAPadding);
+    reserveWithSlack(grid.cellMass, n + QuadTreeSoAPadding);
+    grid.cellX.assign(n + QuadTreeSoAPadding, 0.0f);
+    grid.cellY.assign(n + QuadTreeSoAPadding, 0.0f);
+    grid.cellMass.assign(n + QuadTreeSoAPadding, 0.0f);
+    for (size_t i = 0; i < n; i++) {
+      grid.cellX[i] = grid.cellParticles[i].position.x;
+      grid.cellY[i] = grid.cellParticles[i].position.y;
+      grid.cellMass[i] = grid.cellParticles[i].mass;
+    }
+  }
+
+private:
+  std::vector<int> cellOf, offsets;
+
+  static int gridCells(float extent, float cellSize) {
+    return std::max((int)(extent / cellSize) + 1, 1);
+  }
+
+  // unclamped cell coordinate along one axis, the same rounding for the
+  // build and the queries
+  int cellCoord(float v, float lo) const {
+    return (int)floorf((v - lo) / cellSize);
+  }
+
+  int cellIndex(Vec2 p) const {
+    int ix = std::min(std::max(cellCoord(p.x, bmin.x), 0), nx - 1);
+    int iy = std::min(std::max(cellCoord(p.y, bmin.y), 0), ny - 1);
+    return iy * nx + ix;
+  }
+};
+
+// Maps the -index option to whether to use a CellGrid instead of a QuadTree.
+// "auto" picks the grid unless the particles are so sparse over their bounds
+// that build() would have to grow the cells past cullRadius, where a query
+// would scan far more particles than it keeps and the tree, which adapts to
+// the density, does better.
+inline bool useCellGrid(const std::string &name, Vec2 bmin, Vec2 bmax,
+                        long long numParticles, float cullRadius) {
+  if (name == "grid")
+    return true;
+  if (name != "auto" || numParticles == 0)
+    return false;
+  double cells = ((double)((bmax.x - bmin.x) / cullRadius) + 1.0) *
+                 ((double)((bmax.y - bmin.y) / cullRadius) + 1.0);
+  return cells <= (double)CellGrid::MaxCellsPerParticle * numParticles;
+}
+
+// same, over the bounds of particles
+inline bool useCellGrid(const std::string &name,
+                        const std::vector<Particle> &particles,
+                        float cullRadius) {
+  Vec2 bmin(1e30f, 1e30f);
+  Vec2 bmax(-1e30f, -1e30f);
+  for (auto &p : particles) {
+    bmin.x = fminf(bmin.x, p.position.x);
+    bmin.y = fminf(bmin.y, p.position.y);
+    bmax.x = fmaxf(bmax.x, p.position.x);
+    bmax.y = fmaxf(bmax.y, p.position.y);
+  }
+  return useCellGrid(name, bmin, bmax, particles.size(), cullRadius);
+}
+
+#endif
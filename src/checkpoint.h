@@ -0,0 +1,124 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "arena.h"
+#include "common.h"
+#include "mpi.h"
+#include "particle-io.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+// -checkpoint N: snapshots of the particle state every N steps, in the
+// binary format of particle-io.h, written while the simulation goes on.
+// Every rank copies its particles into a second buffer and hands that to a
+// background thread, which sorts it by id and pwrite()s each run of
+// consecutive ids straight to its place in the file, so no particle crosses
+// the network and no rank waits for another. A snapshot is written to
+// "<name>.part" and renamed to its name once every rank has finished its
+// part, at the next snapshot or at finish(), so a file by the name is
+// complete. The background thread makes no MPI calls.
+//
+// -restart s continues a run from the snapshot of step s, see
+// checkpointFileName.
+class CheckpointWriter {
+public:
+  CheckpointWriter(const std::string &prefix, MPI_Comm comm)
+      : prefix(prefix), comm(comm) {
+    MPI_Comm_rank(comm, &pid);
+  }
+
+  ~CheckpointWriter() {
+    if (!worker.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    worker.join();
+  }
+
+  CheckpointWriter(const CheckpointWriter &) = delete;
+  CheckpointWriter &operator=(const CheckpointWriter &) = delete;
+
+  // Collective over comm. Publishes the previous snapshot, then starts
+  // writing this rank's n particles (ids in [0, total), every id on exactly
+  // one rank) as the snapshot of step.
+  void write(const Particle *particles, size_t n, long long total, int step) {
+    publish();
+    reserveWithSlack(pending, n);
+    pending.assign(particles, particles + n);
+    name = checkpointFileName(prefix, step);
+    count = total;
+    if (!worker.joinable())
+      worker = std::thread([this] { run(); });
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      busy = true;
+    }
+    wake.notify_all();
+    inFlight = true;
+  }
+
+  // Collective over comm: waits for and publishes the last snapshot.
+  void finish() { publish(); }
+
+private:
+  std::string prefix, name;
+  MPI_Comm comm;
+  int pid;
+  long long count = 0;
+  // the copy being written, and its records in id order
+  std::vector<Particle> pending;
+  std::vector<ParticleRecord> records;
+  bool inFlight = false;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  bool busy = false, stop = false;
+
+  void publish() {
+    if (!inFlight)
+      return;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [this] { return !busy; });
+    }
+    MPI_Barrier(comm);
+    if (pid == 0)
+      std::rename((name + ".part").c_str(), name.c_str());
+    inFlight = false;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [this] { return busy || stop; });
+      if (stop)
+        return;
+      lock.unlock();
+      writeSnapshot();
+      lock.lock();
+      busy = false;
+      done.notify_all();
+    }
+  }
+
+  void writeSnapshot() {
+    std::sort(pending.begin(), pending.end(),
+              [](const Particle &a, const Particle &b) { return a.id < b.id; });
+    reserveWithSlack(records, pending.size());
+    int fd = open((name + ".part").c_str(), O_WRONLY | O_CREAT, 0644);
+    assert(fd >= 0 && "Cannot open checkpoint file");
+    if (pid == 0)
+      writeBinaryHeader(fd, count);
+    writeRecordsById(fd, pending.data(), pending.size(), records);
+    close(fd);
+  }
+};
+
+#endif
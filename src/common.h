@@ -1,12 +1,14 @@
 #ifndef COMMON_H_
 #define COMMON_H_
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -17,6 +19,40 @@ struct StartupOptions {
   float viewportRadius = 10.0f;
   float spaceSize = 10.0f;
   bool loadBalance = false;
+  bool mortonOrder = false;
+  bool distributedTree = false;
+  bool refitTree = false;
+  bool pairForces = false;
+  bool dualTree = false;
+  // v2 exchanges between redistributions over a neighbor graph topology
+  bool neighborCollectives = false;
+  // v2 steps per halo exchange, 0 picks it from the measured communication
+  // to compute ratio
+  int blockSteps = 1;
+  // v2 forces and integration on the GPU, needs the cuda build
+  bool gpu = false;
+  // snapshot every checkpointInterval steps (0 for none), see checkpoint.h
+  int checkpointInterval = 0;
+  std::string checkpointFile = "checkpoint";
+  // step of the snapshot the run continues from
+  int restartStep = 0;
+  // v1 block timesteps: particles step by up to 2^timestepLevels steps at a
+  // time, see block-timestep.h
+  int timestepLevels = 0;
+  float timestepAccuracy = 0.25f;
+  // v2 out of core: region files in outOfCoreDir, see out-of-core.h
+  std::string outOfCoreDir;
+  int tileParticles = 65536;
+  // v1 Verlet list skin relative to the cull radius, 0 queries every step
+  float verletSkin = 0.0f;
+  std::string forceKernel = "auto";
+  int numThreads = 1;
+  float theta = 0.0f;
+  std::string spatialIndex = "tree";
+  // particle message format, see WireFormat
+  std::string wireFormat = "compact";
+  bool profile = false;
+  std::string profileFile;
   std::string outputFile;
   std::string inputFile;
 };
@@ -24,6 +60,8 @@ struct StartupOptions {
 struct StepParameters {
   float deltaTime = 0.2f;
   float cullRadius = 1.0f;
+  // Barnes-Hut opening angle, 0 evaluates every particle exactly
+  float theta = 0.0f;
 };
 
 inline StepParameters getBenchmarkStepParams(float spaceSize) {
@@ -33,6 +71,11 @@ inline StepParameters getBenchmarkStepParams(float spaceSize) {
   return result;
 }
 
+// "<prefix>-<step>.bin", the snapshot of the state after step steps
+inline std::string checkpointFileName(const std::string &prefix, int step) {
+  return prefix + "-" + std::to_string(step) + ".bin";
+}
+
 inline StartupOptions parseOptions(int argc, char *argv[]) {
   StartupOptions rs;
   for (int i = 1; i < argc; i++) {
@@ -49,11 +92,69 @@ inline StartupOptions parseOptions(int argc, char *argv[]) {
         rs.viewportRadius = (float)atof(argv[i + 1]);
       else if (strcmp(argv[i], "-o") == 0)
         rs.outputFile = argv[i + 1];
+      else if (strcmp(argv[i], "-kernel") == 0)
+        rs.forceKernel = argv[i + 1];
+      else if (strcmp(argv[i], "-t") == 0)
+        rs.numThreads = atoi(argv[i + 1]);
+      else if (strcmp(argv[i], "-profile-csv") == 0)
+        rs.profileFile = argv[i + 1];
+      else if (strcmp(argv[i], "-index") == 0)
+        rs.spatialIndex = argv[i + 1];
+      else if (strcmp(argv[i], "-theta") == 0)
+        rs.theta = (float)atof(argv[i + 1]);
+      else if (strcmp(argv[i], "-verlet") == 0)
+        rs.verletSkin = (float)atof(argv[i + 1]);
+      else if (strcmp(argv[i], "-checkpoint") == 0)
+        rs.checkpointInterval = atoi(argv[i + 1]);
+      else if (strcmp(argv[i], "-checkpoint-file") == 0)
+        rs.checkpointFile = argv[i + 1];
+      else if (strcmp(argv[i], "-restart") == 0)
+        rs.restartStep = atoi(argv[i + 1]);
+      else if (strcmp(argv[i], "-block") == 0)
+        rs.blockSteps = atoi(argv[i + 1]);
+      else if (strcmp(argv[i], "-timestep-levels") == 0)
+        rs.timestepLevels = atoi(argv[i + 1]);
+      else if (strcmp(argv[i], "-timestep-accuracy") == 0)
+        rs.timestepAccuracy = (float)atof(argv[i + 1]);
+      else if (strcmp(argv[i], "-ooc") == 0)
+        rs.outOfCoreDir = argv[i + 1];
+      else if (strcmp(argv[i], "-ooc-tile") == 0)
+        rs.tileParticles = atoi(argv[i + 1]);
+      else if (strcmp(argv[i], "-wire") == 0)
+        rs.wireFormat = argv[i + 1];
     }
     if (strcmp(argv[i], "-lb") == 0) {
       rs.loadBalance = true;
     }
+    if (strcmp(argv[i], "-morton") == 0) {
+      rs.mortonOrder = true;
+    }
+    if (strcmp(argv[i], "-profile") == 0 ||
+        strcmp(argv[i], "-profile-csv") == 0) {
+      rs.profile = true;
+    }
+    if (strcmp(argv[i], "-dtree") == 0) {
+      rs.distributedTree = true;
+    }
+    if (strcmp(argv[i], "-refit") == 0) {
+      rs.refitTree = true;
+    }
+    if (strcmp(argv[i], "-pairs") == 0) {
+      rs.pairForces = true;
+    }
+    if (strcmp(argv[i], "-dual") == 0) {
+      rs.dualTree = true;
+    }
+    if (strcmp(argv[i], "-gpu") == 0) {
+      rs.gpu = true;
+    }
+    if (strcmp(argv[i], "-neighborhood") == 0) {
+      rs.neighborCollectives = true;
+    }
   }
+  // -restart replaces the input by the snapshot
+  if (rs.restartStep > 0)
+    rs.inputFile = checkpointFileName(rs.checkpointFile, rs.restartStep);
   return rs;
 }
 
@@ -62,6 +163,7 @@ struct Vec2 {
   Vec2(float vx = 0.0f, float vy = 0.0f) : x(vx), y(vy) {}
   static float dot(Vec2 v0, Vec2 v1) { return v0.x * v1.x + v0.y * v1.y; }
   float &operator[](int i) { return ((float *)this)[i]; }
+  float operator[](int i) const { return ((const float *)this)[i]; }
   Vec2 operator*(float s) const { return Vec2(*this) *= s; }
   Vec2 operator*(Vec2 vin) const { return Vec2(*this) *= vin; }
   Vec2 operator+(Vec2 vin) const { return Vec2(*this) += vin; }
@@ -138,6 +240,12 @@ inline bool loadFromFile(std::string fileName,
   std::ifstream f(fileName);
   assert((bool)f && "Cannot open input file");
 
+  // one particle per line
+  particles.reserve(particles.size() +
+                    std::count(std::istreambuf_iterator<char>(f),
+                               std::istreambuf_iterator<char>(), '\n'));
+  f.clear();
+  f.seekg(0);
   std::string line;
   while (std::getline(f, line)) {
     Particle particle;
@@ -167,7 +275,7 @@ inline void saveToFile(std::string fileName,
   f << std::setprecision(9);
   for (auto p : particles) {
     f << p.mass << " " << p.position.x << " " << p.position.y << " "
-      << p.velocity.x << " " << p.velocity.y << std::endl;
+      << p.velocity.x << " " << p.velocity.y << '\n';
   }
   assert((bool)f && "Failed to write to output file");
 }
@@ -0,0 +1,189 @@
+#ifndef DECOMPOSITION_H
+#define DECOMPOSITION_H
+
+#include "common.h"
+#include "mpi.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Uniform px x py grid over the global bounds for any rank count. Rank
+// r = iy * px + ix owns cell (ix, iy). set() picks the factorization
+// px * py == nproc whose cells are closest to square for the domain's aspect
+// ratio.
+class GridDecomposition {
+public:
+  // cells more elongated than this are a poor fit for a grid (e.g. a prime
+  // rank count on a square domain); callers fall back to ORB instead
+  static constexpr float MaxCellAspect = 4.0f;
+
+  int px = 1, py = 1;
+
+  // Returns false if the best grid's cells are more elongated than
+  // MaxCellAspect.
+  bool set(Vec2 globalMin, Vec2 globalMax, int nproc) {
+    Vec2 extent = globalMax - globalMin;
+    float w = fmaxf(extent.x, 1e-6f), h = fmaxf(extent.y, 1e-6f);
+    float bestAspect = 1e30f;
+    for (int x = 1; x <= nproc; x++) {
+      if (nproc % x != 0)
+        continue;
+      int y = nproc / x;
+      float cellW = w / x, cellH = h / y;
+      float aspect = fmaxf(cellW / cellH, cellH / cellW);
+      if (aspect < bestAspect) {
+        bestAspect = aspect;
+        px = x;
+        py = y;
+      }
+    }
+    gmin = globalMin;
+    cell = Vec2(w / px, h / py);
+    return bestAspect <= MaxCellAspect;
+  }
+
+  int ownerOf(Vec2 position) const {
+    int ix = (int)((position.x - gmin.x) / cell.x);
+    int iy = (int)((position.y - gmin.y) / cell.y);
+    ix = std::min(std::max(ix, 0), px - 1);
+    iy = std::min(std::max(iy, 0), py - 1);
+    return iy * px + ix;
+  }
+
+private:
+  Vec2 gmin, cell;
+};
+
+// Cost-weighted orthogonal recursive bisection of the domain over nproc
+// ranks. Starting from the global bounds, every region is cut along its
+// longer side so that the particle cost on each side matches the number of
+// ranks it gets, until every region has one rank. The cuts are found
+// collectively: each level bins the ranks' local particles into a cost
+// histogram per region and reduces it with one MPI_Allreduce, so no rank
+// needs to see other ranks' particles and every rank ends up with the same
+// cuts.
+class OrbDecomposition {
+public:
+  // histogram resolution along the cut axis; the cut is interpolated
+  // inside the bin that crosses the target cost
+  static const int Bins = 512;
+
+  // Recomputes the cuts from the local particles and their costs (any
+  // per-particle work estimate, e.g. neighbor visits; nullptr weighs every
+  // particle equally). Collective over comm, unless replicated is set
+  // because every rank passes the same particles.
+  void build(const std::vector<Particle> &particles, const float *costs,
+             Vec2 globalMin, Vec2 globalMax, int nproc, MPI_Comm comm,
+             bool replicated = false) {
+    nodes.clear();
+    nodes.push_back(Node{globalMin, globalMax, 0, nproc, -1, 0, 0.0f});
+    particleNode.assign(particles.size(), 0);
+
+    std::vector<int> active;
+    for (;;) {
+      active.clear();
+      for (int n = 0; n < (int)nodes.size(); n++)
+        if (nodes[n].left < 0 && nodes[n].rankEnd - nodes[n].rankBegin > 1)
+          active.push_back(n);
+      if (active.empty())
+        break;
+
+      std::vector<int> slot(nodes.size(), -1);
+      for (size_t a = 0; a < active.size(); a++) {
+        Node &node = nodes[active[a]];
+        Vec2 extent = node.bmax - node.bmin;
+        node.axis = extent.y > extent.x ? 1 : 0;
+        slot[active[a]] = (int)a;
+      }
+
+      hist.assign(active.size() * Bins, 0.0);
+      for (size_t i = 0; i < particles.size(); i++) {
+        int s = slot[particleNode[i]];
+        if (s < 0)
+          continue;
+        const Node &node = nodes[particleNode[i]];
+        Vec2 pos = particles[i].position;
+        float lo = node.bmin[node.axis], hi = node.bmax[node.axis];
+        int bin = hi > lo ? (int)((pos[node.axis] - lo) / (hi - lo) * Bins)
+                          : 0;
+        bin = std::min(std::max(bin, 0), Bins - 1);
+        hist[s * Bins + bin] += costs ? std::max(costs[i], 1.0f) : 1.0f;
+      }
+      if (!replicated)
+        MPI_Allreduce(MPI_IN_PLACE, hist.data(), (int)hist.size(),
+                      MPI_DOUBLE, MPI_SUM, comm);
+
+      for (size_t a = 0; a < active.size(); a++)
+        cut(active[a], &hist[a * Bins]);
+
+      // move every particle one level down
+      for (size_t i = 0; i < particles.size(); i++) {
+        const Node &node = nodes[particleNode[i]];
+        if (node.left >= 0)
+          particleNode[i] = childOf(node, particles[i].position);
+      }
+    }
+  }
+
+  bool empty() const { return nodes.empty(); }
+
+  int ownerOf(Vec2 position) const {
+    int n = 0;
+    while (nodes[n].left >= 0)
+      n = childOf(nodes[n], position);
+    return nodes[n].rankBegin;
+  }
+
+private:
+  struct Node {
+    Vec2 bmin, bmax;
+    int rankBegin, rankEnd;
+    int left; // right child is left + 1, -1 for leaves
+    int axis;
+    float split;
+  };
+
+  std::vector<Node> nodes;
+  std::vector<int> particleNode;
+  std::vector<double> hist;
+
+  static int childOf(const Node &node, Vec2 position) {
+    return position[node.axis] < node.split ? node.left : node.left + 1;
+  }
+
+  void cut(int n, const double *h) {
+    const int ranks = nodes[n].rankEnd - nodes[n].rankBegin;
+    const int leftRanks = ranks / 2;
+    double total = 0.0;
+    for (int b = 0; b < Bins; b++)
+      total += h[b];
+    const double target = total * leftRanks / ranks;
+
+    const int axis = nodes[n].axis;
+    const float lo = nodes[n].bmin[axis], hi = nodes[n].bmax[axis];
+    float split = (lo + hi) * 0.5f;
+    double acc = 0.0;
+    for (int b = 0; b < Bins && total > 0.0; b++) {
+      if (acc + h[b] >= target) {
+        double frac = h[b] > 0.0 ? (target - acc) / h[b] : 0.0;
+        split = lo + (float)((b + frac) / Bins) * (hi - lo);
+        break;
+      }
+      acc += h[b];
+    }
+
+    Node leftNode = nodes[n], rightNode = nodes[n];
+    leftNode.bmax[axis] = split;
+    leftNode.rankEnd = nodes[n].rankBegin + leftRanks;
+    rightNode.bmin[axis] = split;
+    rightNode.rankBegin = leftNode.rankEnd;
+    leftNode.left = rightNode.left = -1;
+
+    nodes[n].split = split;
+    nodes[n].left = (int)nodes.size();
+    nodes.push_back(leftNode);
+    nodes.push_back(rightNode);
+  }
+};
+
+#endif
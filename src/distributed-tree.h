@@ -0,0 +1,270 @@
+#ifndef DISTRIBUTED_TREE_H
+#define DISTRIBUTED_TREE_H
+
+#include "common.h"
+#include "mpi.h"
+#include "quad-tree.h"
+#include <algorithm>
+#include <vector>
+
+// Builds a QuadTree over the particles of all ranks without any rank building
+// the whole tree. The global bounds are cut into 4^levels top-level cells,
+// the same boxes buildQuadTree splits into at that depth. Cells are handed
+// out to ranks as contiguous runs in tree order holding about N / nproc
+// particles each, every rank builds the subtrees of its own cells only, and
+// the subtrees and their particles are all-gathered. Each rank then links
+// them below the top levels, which only need the global cell counts.
+class DistributedTree {
+public:
+  // the top levels are deepened until there are this many cells per rank
+  static const int CellsPerRank = 16;
+  static const int MaxLevels = 8;
+
+  // range of tree.leafParticles covered by this rank's cells after build()
+  int ownedBegin = 0, ownedEnd = 0;
+
+  // Collective over comm. owned holds the particles this rank moves this
+  // iteration (any subset, together the ranks hold every particle exactly
+  // once). On return tree holds all particles, and the ones in
+  // [ownedBegin, ownedEnd) are the particles this rank should move next.
+  void build(const std::vector<Particle> &owned, QuadTree &tree,
+             MPI_Comm comm) {
+    int pid, nproc;
+    MPI_Comm_rank(comm, &pid);
+    MPI_Comm_size(comm, &nproc);
+
+    float lo[2] = {1e30f, 1e30f}, hi[2] = {-1e30f, -1e30f};
+    for (auto &p : owned) {
+      lo[0] = fminf(lo[0], p.position.x);
+      lo[1] = fminf(lo[1], p.position.y);
+      hi[0] = fmaxf(hi[0], p.position.x);
+      hi[1] = fmaxf(hi[1], p.position.y);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, lo, 2, MPI_FLOAT, MPI_MIN, comm);
+    MPI_Allreduce(MPI_IN_PLACE, hi, 2, MPI_FLOAT, MPI_MAX, comm);
+    tree.bmin = Vec2(lo[0], lo[1]);
+    tree.bmax = Vec2(hi[0], hi[1]);
+
+    levels = 1;
+    while (levels < MaxLevels && (1 << (2 * levels)) < CellsPerRank * nproc)
+      levels++;
+    const int numCells = 1 << (2 * levels);
+
+    // bucket the owned particles by cell and count every cell globally
+    reserveWithSlack(cellOf, owned.size());
+    cellOf.resize(owned.size());
+    localCounts.assign(numCells, 0);
+    for (size_t i = 0; i < owned.size(); i++) {
+      cellOf[i] = cellIndex(owned[i].position, tree.bmin, tree.bmax);
+      localCounts[cellOf[i]]++;
+    }
+    counts = localCounts;
+    MPI_Allreduce(MPI_IN_PLACE, counts.data(), numCells, MPI_INT, MPI_SUM,
+                  comm);
+    cellStart.resize(numCells + 1);
+    cellStart[0] = 0;
+    for (int c = 0; c < numCells; c++)
+      cellStart[c + 1] = cellStart[c] + counts[c];
+    const int total = cellStart[numCells];
+
+    // a cell goes to the rank whose share of the particles holds its middle
+    rankCell.assign(nproc + 1, numCells);
+    for (int c = numCells - 1; c >= 0; c--) {
+      long long middle = ((long long)cellStart[c] + cellStart[c + 1]) / 2;
+      int owner = total > 0 ? (int)(middle * nproc / total) : 0;
+      rankCell[std::min(owner, nproc - 1)] = c;
+    }
+    rankCell[0] = 0;
+    for (int r = nproc - 1; r > 0; r--)
+      rankCell[r] = std::min(rankCell[r], rankCell[r + 1]);
+
+    exchange(owned, nproc, comm);
+    buildLocal(tree.bmin, tree.bmax, pid);
+    share(tree, nproc, comm);
+    linkTopLevels(tree, nproc);
+    tree.refreshSoA();
+
+    ownedBegin = cellStart[rankCell[pid]];
+    ownedEnd = cellStart[rankCell[pid + 1]];
+  }
+
+private:
+  int levels = 1;
+  // global cell counts and their prefix sums
+  std::vector<int> localCounts, counts, cellStart;
+  // rank r owns cells [rankCell[r], rankCell[r + 1])
+  std::vector<int> rankCell;
+  std::vector<int> cellOf;
+  std::vector<Particle> sendBuf, recvBuf;
+  std::vector<int> sendBytes, sendDispl, recvBytes, recvDispl;
+  // subtrees of this rank's cells, one root per cell at nodes[0, numCells)
+  QuadTree local;
+  std::vector<int> nodeBase, nodeBytes, nodeDispl;
+
+  // cell of a point at depth levels, following buildQuadTree's splits
+  int cellIndex(Vec2 p, Vec2 bmin, Vec2 bmax) const {
+    int cell = 0;
+    for (int l = 0; l < levels; l++) {
+      int q = QuadTree::quadrant(p, (bmin.x + bmax.x) / 2,
+                                 (bmin.y + bmax.y) / 2);
+      QuadTree::childBounds(bmin, bmax, q, bmin, bmax);
+      cell = cell * 4 + q;
+    }
+    return cell;
+  }
+
+  void cellBounds(int cell, Vec2 &bmin, Vec2 &bmax) const {
+    for (int l = levels - 1; l >= 0; l--)
+      QuadTree::childBounds(bmin, bmax, (cell >> (2 * l)) & 3, bmin, bmax);
+  }
+
+  // every particle moves to the rank owning its cell
+  void exchange(const std::vector<Particle> &owned, int nproc,
+                MPI_Comm comm) {
+    const int numCells = (int)localCounts.size();
+    std::vector<int> &offset = counts; // global counts are in cellStart now
+    int acc = 0;
+    for (int c = 0; c < numCells; c++) {
+      offset[c] = acc;
+      acc += localCounts[c];
+    }
+    reserveWithSlack(sendBuf, owned.size());
+    sendBuf.resize(owned.size());
+    for (size_t i = 0; i < owned.size(); i++)
+      sendBuf[offset[cellOf[i]]++] = owned[i];
+
+    sendBytes.assign(nproc, 0);
+    sendDispl.assign(nproc, 0);
+    recvBytes.assign(nproc, 0);
+    recvDispl.assign(nproc, 0);
+    for (int r = 0, sent = 0; r < nproc; r++) {
+      for (int c = rankCell[r]; c < rankCell[r + 1]; c++)
+        sendBytes[r] += localCounts[c] * (int)sizeof(Particle);
+      sendDispl[r] = sent;
+      sent += sendBytes[r];
+    }
+    MPI_Alltoall(sendBytes.data(), 1, MPI_INT, recvBytes.data(), 1, MPI_INT,
+                 comm);
+    int received = 0;
+    for (int r = 0; r < nproc; r++) {
+      recvDispl[r] = received;
+      received += recvBytes[r];
+    }
+    reserveWithSlack(recvBuf, received / sizeof(Particle));
+    recvBuf.resize(received / sizeof(Particle));
+    MPI_Alltoallv(sendBuf.data(), sendBytes.data(), sendDispl.data(),
+                  MPI_BYTE, recvBuf.data(), recvBytes.data(), recvDispl.data(),
+                  MPI_BYTE, comm);
+  }
+
+  void buildLocal(Vec2 bmin, Vec2 bmax, int pid) {
+    const int firstCell = rankCell[pid], numOwn = rankCell[pid + 1] - firstCell;
+    const int base = cellStart[firstCell];
+
+    // stable counting sort of the received particles by cell
+    std::vector<int> &offset = localCounts;
+    for (int k = 0; k < numOwn; k++)
+      offset[k] = cellStart[firstCell + k] - base;
+    reserveWithSlack(local.leafParticles, recvBuf.size());
+    local.leafParticles.resize(recvBuf.size());
+    for (auto &p : recvBuf)
+      local.leafParticles[offset[cellIndex(p.position, bmin, bmax) -
+                                 firstCell]++] = p;
+
+    reserveWithSlack(local.nodes, numOwn);
+    local.nodes.assign(numOwn, FlatQuadTreeNode());
+    for (int k = 0; k < numOwn; k++) {
+      FlatQuadTreeNode &root = local.nodes[k];
+      root.bmin = bmin;
+      root.bmax = bmax;
+      cellBounds(firstCell + k, root.bmin, root.bmax);
+      root.begin = cellStart[firstCell + k] - base;
+      root.end = cellStart[firstCell + k + 1] - base;
+    }
+    local.buildForest(numOwn);
+  }
+
+  int topNodes() const { return ((1 << (2 * (levels + 1))) - 1) / 3; }
+
+  // gathers every rank's subtrees after the top levels of tree.nodes and
+  // their particles into tree.leafParticles, in cell order
+  void share(QuadTree &tree, int nproc, MPI_Comm comm) {
+    int myBytes = (int)(local.nodes.size() * sizeof(FlatQuadTreeNode));
+    nodeBytes.resize(nproc);
+    nodeDispl.resize(nproc);
+    nodeBase.resize(nproc);
+    MPI_Allgather(&myBytes, 1, MPI_INT, nodeBytes.data(), 1, MPI_INT, comm);
+    int acc = 0;
+    for (int r = 0; r < nproc; r++) {
+      nodeDispl[r] = acc;
+      nodeBase[r] = topNodes() + acc / (int)sizeof(FlatQuadTreeNode);
+      acc += nodeBytes[r];
+    }
+    reserveWithSlack(tree.nodes, topNodes() + acc / sizeof(FlatQuadTreeNode));
+    tree.nodes.resize(topNodes() + acc / sizeof(FlatQuadTreeNode));
+    MPI_Allgatherv(local.nodes.data(), myBytes, MPI_BYTE,
+                   tree.nodes.data() + topNodes(), nodeBytes.data(),
+                   nodeDispl.data(), MPI_BYTE, comm);
+
+    for (int r = 0; r < nproc; r++) {
+      recvBytes[r] = (cellStart[rankCell[r + 1]] - cellStart[rankCell[r]]) *
+                     (int)sizeof(Particle);
+      recvDispl[r] = cellStart[rankCell[r]] * (int)sizeof(Particle);
+    }
+    tree.leafParticles.resize(cellStart.back());
+    MPI_Allgatherv(local.leafParticles.data(),
+                   (int)(local.leafParticles.size() * sizeof(Particle)),
+                   MPI_BYTE, tree.leafParticles.data(), recvBytes.data(),
+                   recvDispl.data(), MPI_BYTE, comm);
+
+    // subtree ranges and links were relative to their rank's block
+    for (int r = 0; r < nproc; r++) {
+      const int first = nodeBase[r];
+      const int last = first + nodeBytes[r] / (int)sizeof(FlatQuadTreeNode);
+      const int particleBase = cellStart[rankCell[r]];
+      for (int n = first; n < last; n++) {
+        FlatQuadTreeNode &node = tree.nodes[n];
+        node.begin += particleBase;
+        node.end += particleBase;
+        if (!node.isLeaf())
+          node.firstChild += first;
+      }
+    }
+  }
+
+  // Fills in the top levels, stored level by level so that the children of
+  // node k of a level are nodes 4k..4k+3 of the next. The deepest level
+  // copies the cells' subtree roots. Top nodes with few particles become
+  // leaves, as buildQuadTree would make them.
+  void linkTopLevels(QuadTree &tree, int nproc) {
+    tree.nodes[0].bmin = tree.bmin;
+    tree.nodes[0].bmax = tree.bmax;
+    int owner = 0;
+    for (int l = 0, levelBegin = 0; l <= levels; l++) {
+      const int width = 1 << (2 * l), span = 1 << (2 * (levels - l));
+      for (int k = 0; k < width; k++) {
+        FlatQuadTreeNode &node = tree.nodes[levelBegin + k];
+        if (l == levels) {
+          while (owner < nproc - 1 && k >= rankCell[owner + 1])
+            owner++;
+          node = tree.nodes[nodeBase[owner] + k - rankCell[owner]];
+          continue;
+        }
+        node.begin = cellStart[k * span];
+        node.end = cellStart[(k + 1) * span];
+        node.firstChild = -1;
+        if (node.size() <= QuadTreeLeafSize)
+          continue;
+        node.firstChild = levelBegin + width + 4 * k;
+        for (int c = 0; c < 4; c++) {
+          FlatQuadTreeNode &child = tree.nodes[node.firstChild + c];
+          QuadTree::childBounds(node.bmin, node.bmax, c, child.bmin,
+                                child.bmax);
+        }
+      }
+      levelBegin += width;
+    }
+  }
+};
+
+#endif
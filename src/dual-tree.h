@@ -0,0 +1,89 @@
+#ifndef DUAL_TREE_H
+#define DUAL_TREE_H
+
+#include "common.h"
+#include "force-kernel.h"
+#include "quad-tree.h"
+#include "thread-pool.h"
+
+// Leaf-vs-leaf force evaluation: instead of one source-tree traversal per
+// target particle, each leaf of a target tree collects the source leaves
+// within cullRadius of its bounds once, and its targets are then evaluated
+// against that list one source leaf at a time, so a source leaf's SoA range
+// stays in cache across all targets of the leaf. The kernels still drop the
+// sources outside cullRadius of each target, so the forces are exact.
+class DualTreeForces {
+public:
+  // Starts a pass over the leaves of targets, clearing the results.
+  void begin(const QuadTree &targets, ThreadPool &pool) {
+    leaves.clear();
+    leaves.reserve(targets.nodes.capacity());
+    for (int n = 0; n < (int)targets.nodes.size(); n++)
+      if (targets.nodes[n].isLeaf() && targets.nodes[n].size() > 0)
+        leaves.push_back(n);
+    reserveWithSlack(forces, targets.leafParticles.size());
+    reserveWithSlack(costs, targets.leafParticles.size());
+    forces.assign(targets.leafParticles.size(), Vec2(0.0f, 0.0f));
+    costs.assign(targets.leafParticles.size(), 0.0f);
+    sourceLeaves.resize(pool.size());
+  }
+
+  size_t numLeaves() const { return leaves.size(); }
+
+  // Evaluates the target leaves [begin, end) of the pass against sources,
+  // so a caller can interleave other work between blocks of leaves.
+  void accumulate(const QuadTree &targets, const QuadTree &sources,
+                  size_t begin, size_t end, float cullRadius,
+                  ForceKernelFn kernel, ThreadPool &pool) {
+    pool.parallelFor(begin, end, 1, [&](size_t b, size_t e, int w) {
+      std::vector<int> &near = sourceLeaves[w];
+      const float *x = sources.leafX.data(), *y = sources.leafY.data();
+      const float *mass = sources.leafMass.data();
+      for (size_t l = b; l < e; l++) {
+        const FlatQuadTreeNode &leaf = targets.nodes[leaves[l]];
+        // leaf bounds are quadrants, which can be far larger than the
+        // particles in them on sparse inputs
+        Vec2 lo(1e30f, 1e30f), hi(-1e30f, -1e30f);
+        for (int i = leaf.begin; i < leaf.end; i++) {
+          lo.x = fminf(lo.x, targets.leafX[i]);
+          lo.y = fminf(lo.y, targets.leafY[i]);
+          hi.x = fmaxf(hi.x, targets.leafX[i]);
+          hi.y = fmaxf(hi.y, targets.leafY[i]);
+        }
+        near.clear();
+        sources.forEachLeafNearBox(lo, hi, cullRadius,
+                                   [&](int s) { near.push_back(s); });
+        for (int s : near) {
+          const FlatQuadTreeNode &src = sources.nodes[s];
+          for (int i = leaf.begin; i < leaf.end; i++) {
+            const Vec2 p(targets.leafX[i], targets.leafY[i]);
+            // the per-target test of QuadTree::forEachLeaf
+            if (boxPointDistance(src.bmin, src.bmax, p) > cullRadius)
+              continue;
+            forces[i] += kernel(p, targets.leafMass[i], x, y, mass, src.begin,
+                                src.end, cullRadius);
+            costs[i] += (float)src.size();
+          }
+        }
+      }
+    });
+  }
+
+  // Calls f(slot, force, cost) for every slot of targets.leafParticles with
+  // its total force and the number of sources evaluated for it.
+  template <typename F> void finish(const QuadTree &targets, F &&f) const {
+    for (size_t k = 0; k < targets.leafParticles.size(); k++)
+      f((int)k, forces[k], costs[k]);
+  }
+
+private:
+  std::vector<int> leaves;
+  // indexed by target slot; every slot belongs to one leaf, so the workers
+  // never share one
+  std::vector<Vec2> forces;
+  std::vector<float> costs;
+  // per worker scratch
+  std::vector<std::vector<int>> sourceLeaves;
+};
+
+#endif
@@ -0,0 +1,473 @@
+#ifndef FORCE_KERNEL_H
+#define FORCE_KERNEL_H
+
+#include "cell-grid.h"
+#include "common.h"
+#include "quad-tree.h"
+#include <immintrin.h>
+
+// Force accumulation over structure-of-arrays attractors. Every kernel
+// computes the sum of computeForce(target, attractor[i], cullRadius) for
+// i in [begin, end); the vector kernels evaluate 8 / 16 attractors at once
+// and replace computeForce's early returns and clamps with masks and blends.
+// They may read up to 15 elements past end, see QuadTreeSoAPadding.
+static_assert(QuadTreeSoAPadding >= 15, "SoA arrays need kernel padding");
+
+enum class ForceKernelISA { Scalar, AVX2, AVX512 };
+
+typedef Vec2 (*ForceKernelFn)(Vec2 targetPosition, float targetMass,
+                              const float *x, const float *y,
+                              const float *mass, int begin, int end,
+                              float cullRadius);
+
+inline Vec2 accumulateForceScalar(Vec2 targetPosition, float targetMass,
+                                  const float *x, const float *y,
+                                  const float *mass, int begin, int end,
+                                  float cullRadius) {
+  Particle target, attractor;
+  target.mass = targetMass;
+  target.position = targetPosition;
+  Vec2 force(0.0f, 0.0f);
+  for (int i = begin; i < end; i++) {
+    attractor.mass = mass[i];
+    attractor.position = Vec2(x[i], y[i]);
+    force += computeForce(target, attractor, cullRadius);
+  }
+  return force;
+}
+
+__attribute__((target("avx2,fma"))) inline Vec2
+accumulateForceAVX2(Vec2 targetPosition, float targetMass, const float *x,
+                    const float *y, const float *mass, int begin, int end,
+                    float cullRadius) {
+  const __m256 tx = _mm256_set1_ps(targetPosition.x);
+  const __m256 ty = _mm256_set1_ps(targetPosition.y);
+  const __m256 tm = _mm256_set1_ps(targetMass);
+  const __m256 cull = _mm256_set1_ps(cullRadius);
+  const __m256 decayStart = _mm256_set1_ps(cullRadius * 0.75f);
+  const __m256 decayWidth = _mm256_set1_ps(cullRadius * 0.25f);
+  const __m256 minDist = _mm256_set1_ps(1e-3f);
+  const __m256 clampDist = _mm256_set1_ps(1e-1f);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 G = _mm256_set1_ps(0.01f);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i vend = _mm256_set1_epi32(end);
+
+  __m256 fx = _mm256_setzero_ps();
+  __m256 fy = _mm256_setzero_ps();
+  for (int i = begin; i < end; i += 8) {
+    __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), tx);
+    __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), ty);
+    __m256 am = _mm256_loadu_ps(mass + i);
+    __m256 dist = _mm256_sqrt_ps(
+        _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
+
+    __m256i idx = _mm256_add_epi32(_mm256_set1_epi32(i), lanes);
+    __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(vend, idx));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(dist, minDist, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(dist, cull, _CMP_LE_OQ));
+
+    __m256 inv = _mm256_div_ps(one, dist);
+    __m256 d = _mm256_max_ps(dist, clampDist);
+    __m256 s = _mm256_div_ps(G, _mm256_mul_ps(d, d));
+    __m256 decay = _mm256_sub_ps(
+        one, _mm256_div_ps(_mm256_sub_ps(d, decayStart), decayWidth));
+    s = _mm256_blendv_ps(s, _mm256_mul_ps(s, decay),
+                         _mm256_cmp_ps(d, decayStart, _CMP_GT_OQ));
+    __m256 scale = _mm256_mul_ps(_mm256_mul_ps(tm, am), s);
+    // masked lanes may hold inf / NaN (dist == 0), so mask after multiplying
+    __m256 px = _mm256_mul_ps(_mm256_mul_ps(dx, inv), scale);
+    __m256 py = _mm256_mul_ps(_mm256_mul_ps(dy, inv), scale);
+    fx = _mm256_add_ps(fx, _mm256_and_ps(px, valid));
+    fy = _mm256_add_ps(fy, _mm256_and_ps(py, valid));
+  }
+
+  alignas(32) float sx[8], sy[8];
+  _mm256_store_ps(sx, fx);
+  _mm256_store_ps(sy, fy);
+  Vec2 force(0.0f, 0.0f);
+  for (int l = 0; l < 8; l++) {
+    force.x += sx[l];
+    force.y += sy[l];
+  }
+  return force;
+}
+
+// _mm512_reduce_add_ps in the same summation order. GCC 12 reports the
+// _mm512_undefined_* passthrough operands of the unmasked AVX-512
+// intrinsics as used uninitialized, so the kernels stay clear of them:
+// max and sqrt use the maskz forms with all lanes set.
+__attribute__((target("avx512f"))) inline float reduceAdd512(__m512 v) {
+  alignas(64) float l[16];
+  _mm512_store_ps(l, v);
+  float h[8], q[4];
+  for (int i = 0; i < 8; i++)
+    h[i] = l[i] + l[i + 8];
+  for (int i = 0; i < 4; i++)
+    q[i] = h[i] + h[i + 4];
+  return (q[0] + q[2]) + (q[1] + q[3]);
+}
+
+__attribute__((target("avx512f"))) inline Vec2
+accumulateForceAVX512(Vec2 targetPosition, float targetMass, const float *x,
+                      const float *y, const float *mass, int begin, int end,
+                      float cullRadius) {
+  const __m512 tx = _mm512_set1_ps(targetPosition.x);
+  const __m512 ty = _mm512_set1_ps(targetPosition.y);
+  const __m512 tm = _mm512_set1_ps(targetMass);
+  const __m512 cull = _mm512_set1_ps(cullRadius);
+  const __m512 decayStart = _mm512_set1_ps(cullRadius * 0.75f);
+  const __m512 decayWidth = _mm512_set1_ps(cullRadius * 0.25f);
+  const __m512 minDist = _mm512_set1_ps(1e-3f);
+  const __m512 clampDist = _mm512_set1_ps(1e-1f);
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512 G = _mm512_set1_ps(0.01f);
+  const __mmask16 all = (__mmask16)0xffff;
+
+  __m512 fx = _mm512_setzero_ps();
+  __m512 fy = _mm512_setzero_ps();
+  for (int i = begin; i < end; i += 16) {
+    __mmask16 lanes = end - i >= 16 ? all : (__mmask16)((1u << (end - i)) - 1);
+    __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(x + i), tx);
+    __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(y + i), ty);
+    __m512 am = _mm512_loadu_ps(mass + i);
+    __m512 dist = _mm512_maskz_sqrt_ps(
+        all, _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)));
+
+    __mmask16 valid = lanes &
+                      _mm512_cmp_ps_mask(dist, minDist, _CMP_GE_OQ) &
+                      _mm512_cmp_ps_mask(dist, cull, _CMP_LE_OQ);
+
+    __m512 inv = _mm512_div_ps(one, dist);
+    __m512 d = _mm512_maskz_max_ps(all, dist, clampDist);
+    __m512 s = _mm512_div_ps(G, _mm512_mul_ps(d, d));
+    __m512 decay = _mm512_sub_ps(
+        one, _mm512_div_ps(_mm512_sub_ps(d, decayStart), decayWidth));
+    s = _mm512_mask_mul_ps(s, _mm512_cmp_ps_mask(d, decayStart, _CMP_GT_OQ),
+                           s, decay);
+    __m512 scale = _mm512_mul_ps(_mm512_mul_ps(tm, am), s);
+    fx = _mm512_mask_add_ps(fx, valid, fx,
+                            _mm512_mul_ps(_mm512_mul_ps(dx, inv), scale));
+    fy = _mm512_mask_add_ps(fy, valid, fy,
+                            _mm512_mul_ps(_mm512_mul_ps(dy, inv), scale));
+  }
+  return Vec2(reduceAdd512(fx), reduceAdd512(fy));
+}
+
+// Pair kernels, for evaluating every pair once (see pair-force.h): return
+// the same sum as the kernels above and also subtract each attractor's term
+// from reactionX / reactionY[i], the force on the attractor. The vector
+// kernels add masked zeros to up to 15 elements past end.
+typedef Vec2 (*PairForceKernelFn)(Vec2 targetPosition, float targetMass,
+                                  const float *x, const float *y,
+                                  const float *mass, int begin, int end,
+                                  float cullRadius, float *reactionX,
+                                  float *reactionY);
+
+inline Vec2 accumulatePairForceScalar(Vec2 targetPosition, float targetMass,
+                                      const float *x, const float *y,
+                                      const float *mass, int begin, int end,
+                                      float cullRadius, float *reactionX,
+                                      float *reactionY) {
+  Particle target, attractor;
+  target.mass = targetMass;
+  target.position = targetPosition;
+  Vec2 force(0.0f, 0.0f);
+  for (int i = begin; i < end; i++) {
+    attractor.mass = mass[i];
+    attractor.position = Vec2(x[i], y[i]);
+    Vec2 f = computeForce(target, attractor, cullRadius);
+    force += f;
+    reactionX[i] -= f.x;
+    reactionY[i] -= f.y;
+  }
+  return force;
+}
+
+__attribute__((target("avx2,fma"))) inline Vec2 accumulatePairForceAVX2(
+    Vec2 targetPosition, float targetMass, const float *x, const float *y,
+    const float *mass, int begin, int end, float cullRadius, float *reactionX,
+    float *reactionY) {
+  const __m256 tx = _mm256_set1_ps(targetPosition.x);
+  const __m256 ty = _mm256_set1_ps(targetPosition.y);
+  const __m256 tm = _mm256_set1_ps(targetMass);
+  const __m256 cull = _mm256_set1_ps(cullRadius);
+  const __m256 decayStart = _mm256_set1_ps(cullRadius * 0.75f);
+  const __m256 decayWidth = _mm256_set1_ps(cullRadius * 0.25f);
+  const __m256 minDist = _mm256_set1_ps(1e-3f);
+  const __m256 clampDist = _mm256_set1_ps(1e-1f);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 G = _mm256_set1_ps(0.01f);
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i vend = _mm256_set1_epi32(end);
+
+  __m256 fx = _mm256_setzero_ps();
+  __m256 fy = _mm256_setzero_ps();
+  for (int i = begin; i < end; i += 8) {
+    __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), tx);
+    __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), ty);
+    __m256 am = _mm256_loadu_ps(mass + i);
+    __m256 dist = _mm256_sqrt_ps(
+        _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)));
+
+    __m256i idx = _mm256_add_epi32(_mm256_set1_epi32(i), lanes);
+    __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(vend, idx));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(dist, minDist, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(dist, cull, _CMP_LE_OQ));
+
+    __m256 inv = _mm256_div_ps(one, dist);
+    __m256 d = _mm256_max_ps(dist, clampDist);
+    __m256 s = _mm256_div_ps(G, _mm256_mul_ps(d, d));
+    __m256 decay = _mm256_sub_ps(
+        one, _mm256_div_ps(_mm256_sub_ps(d, decayStart), decayWidth));
+    s = _mm256_blendv_ps(s, _mm256_mul_ps(s, decay),
+                         _mm256_cmp_ps(d, decayStart, _CMP_GT_OQ));
+    __m256 scale = _mm256_mul_ps(_mm256_mul_ps(tm, am), s);
+    __m256 px = _mm256_and_ps(_mm256_mul_ps(_mm256_mul_ps(dx, inv), scale),
+                              valid);
+    __m256 py = _mm256_and_ps(_mm256_mul_ps(_mm256_mul_ps(dy, inv), scale),
+                              valid);
+    fx = _mm256_add_ps(fx, px);
+    fy = _mm256_add_ps(fy, py);
+    _mm256_storeu_ps(reactionX + i,
+                     _mm256_sub_ps(_mm256_loadu_ps(reactionX + i), px));
+    _mm256_storeu_ps(reactionY + i,
+                     _mm256_sub_ps(_mm256_loadu_ps(reactionY + i), py));
+  }
+
+  alignas(32) float sx[8], sy[8];
+  _mm256_store_ps(sx, fx);
+  _mm256_store_ps(sy, fy);
+  Vec2 force(0.0f, 0.0f);
+  for (int l = 0; l < 8; l++) {
+    force.x += sx[l];
+    force.y += sy[l];
+  }
+  return force;
+}
+
+__attribute__((target("avx512f"))) inline Vec2 accumulatePairForceAVX512(
+    Vec2 targetPosition, float targetMass, const float *x, const float *y,
+    const float *mass, int begin, int end, float cullRadius, float *reactionX,
+    float *reactionY) {
+  const __m512 tx = _mm512_set1_ps(targetPosition.x);
+  const __m512 ty = _mm512_set1_ps(targetPosition.y);
+  const __m512 tm = _mm512_set1_ps(targetMass);
+  const __m512 cull = _mm512_set1_ps(cullRadius);
+  const __m512 decayStart = _mm512_set1_ps(cullRadius * 0.75f);
+  const __m512 decayWidth = _mm512_set1_ps(cullRadius * 0.25f);
+  const __m512 minDist = _mm512_set1_ps(1e-3f);
+  const __m512 clampDist = _mm512_set1_ps(1e-1f);
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512 G = _mm512_set1_ps(0.01f);
+  const __mmask16 all = (__mmask16)0xffff;
+
+  __m512 fx = _mm512_setzero_ps();
+  __m512 fy = _mm512_setzero_ps();
+  for (int i = begin; i < end; i += 16) {
+    __mmask16 lanes = end - i >= 16 ? all : (__mmask16)((1u << (end - i)) - 1);
+    __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(x + i), tx);
+    __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(y + i), ty);
+    __m512 am = _mm512_loadu_ps(mass + i);
+    __m512 dist = _mm512_maskz_sqrt_ps(
+        all, _mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)));
+
+    __mmask16 valid = lanes &
+                      _mm512_cmp_ps_mask(dist, minDist, _CMP_GE_OQ) &
+                      _mm512_cmp_ps_mask(dist, cull, _CMP_LE_OQ);
+
+    __m512 inv = _mm512_div_ps(one, dist);
+    __m512 d = _mm512_maskz_max_ps(all, dist, clampDist);
+    __m512 s = _mm512_div_ps(G, _mm512_mul_ps(d, d));
+    __m512 decay = _mm512_sub_ps(
+        one, _mm512_div_ps(_mm512_sub_ps(d, decayStart), decayWidth));
+    s = _mm512_mask_mul_ps(s, _mm512_cmp_ps_mask(d, decayStart, _CMP_GT_OQ),
+                           s, decay);
+    __m512 scale = _mm512_mul_ps(_mm512_mul_ps(tm, am), s);
+    __m512 px = _mm512_maskz_mul_ps(valid, _mm512_mul_ps(dx, inv), scale);
+    __m512 py = _mm512_maskz_mul_ps(valid, _mm512_mul_ps(dy, inv), scale);
+    fx = _mm512_add_ps(fx, px);
+    fy = _mm512_add_ps(fy, py);
+    _mm512_mask_storeu_ps(
+        reactionX + i, lanes,
+        _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, reactionX + i), px));
+    _mm512_mask_storeu_ps(
+        reactionY + i, lanes,
+        _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, reactionY + i), py));
+  }
+  return Vec2(reduceAdd512(fx), reduceAdd512(fy));
+}
+
+// Picks the widest ISA the current CPU supports.
+inline ForceKernelISA detectForceKernelISA() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return ForceKernelISA::AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return ForceKernelISA::AVX2;
+  return ForceKernelISA::Scalar;
+}
+
+// Maps the -kernel option to an ISA; "auto" detects at runtime. An ISA the
+// CPU does not support falls back to the best supported one.
+inline ForceKernelISA parseForceKernelISA(const std::string &name) {
+  ForceKernelISA best = detectForceKernelISA();
+  if (name == "scalar")
+    return ForceKernelISA::Scalar;
+  if (name == "avx2" && best != ForceKernelISA::Scalar)
+    return ForceKernelISA::AVX2;
+  if (name == "avx512" && best == ForceKernelISA::AVX512)
+    return ForceKernelISA::AVX512;
+  return best;
+}
+
+inline const char *forceKernelName(ForceKernelISA isa) {
+  switch (isa) {
+  case ForceKernelISA::AVX512:
+    return "avx512";
+  case ForceKernelISA::AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+inline ForceKernelFn selectForceKernel(ForceKernelISA isa) {
+  switch (isa) {
+  case ForceKernelISA::AVX512:
+    return accumulateForceAVX512;
+  case ForceKernelISA::AVX2:
+    return accumulateForceAVX2;
+  default:
+    return accumulateForceScalar;
+  }
+}
+
+inline PairForceKernelFn selectPairForceKernel(ForceKernelISA isa) {
+  switch (isa) {
+  case ForceKernelISA::AVX512:
+    return accumulatePairForceAVX512;
+  case ForceKernelISA::AVX2:
+    return accumulatePairForceAVX2;
+  default:
+    return accumulatePairForceScalar;
+  }
+}
+
+// Total force on target from every particle of the tree within cullRadius,
+// evaluated leaf by leaf on the tree's SoA storage. If visited is given, the
+// number of attractors evaluated is added to it.
+inline Vec2 accumulateTreeForce(const QuadTree &tree, const Particle &target,
+                                float cullRadius, ForceKernelFn kernel,
+                                int *visited = nullptr) {
+  Vec2 force(0.0f, 0.0f);
+  int count = 0;
+  tree.forEachLeaf(target.position, cullRadius,
+                   [&](const FlatQuadTreeNode &leaf, bool) {
+                     force += kernel(target.position, target.mass,
+                                     tree.leafX.data(), tree.leafY.data(),
+                                     tree.leafMass.data(), leaf.begin,
+                                     leaf.end, cullRadius);
+                     count += leaf.size();
+                   });
+  if (visited)
+    *visited += count;
+  return force;
+}
+
+inline void barnesHutImpl(const QuadTree &tree, int nodeIndex,
+                          const Particle &target, float cullRadius,
+                          float theta, ForceKernelFn kernel, Vec2 &force,
+                          int &count) {
+  const FlatQuadTreeNode &node = tree.nodes[nodeIndex];
+  // only nodes entirely within cullRadius that do not contain the target
+  // may be summarized, so the cutoff stays exact
+  if (boxPointMaxDistance(node.bmin, node.bmax, target.position) <
+          cullRadius &&
+      boxPointDistance(node.bmin, node.bmax, target.position) > 0.0f) {
+    Vec2 extent = node.bmax - node.bmin;
+    float size = fmaxf(extent.x, extent.y);
+    Vec2 center = tree.nodeCenterOfMass[nodeIndex];
+    if (size < theta * (center - target.position).length()) {
+      Particle summary;
+      summary.mass = tree.nodeMass[nodeIndex];
+      summary.position = center;
+      force += computeForce(target, summary, cullRadius);
+      count++;
+      return;
+    }
+  }
+  if (node.isLeaf()) {
+    force += kernel(target.position, target.mass, tree.leafX.data(),
+                    tree.leafY.data(), tree.leafMass.data(), node.begin,
+                    node.end, cullRadius);
+    count += node.size();
+    return;
+  }
+  for (int c = 0; c < 4; c++) {
+    const FlatQuadTreeNode &child = tree.nodes[node.firstChild + c];
+    if (child.size() > 0 &&
+        boxPointDistance(child.bmin, child.bmax, target.position) <=
+            cullRadius)
+      barnesHutImpl(tree, node.firstChild + c, target, cullRadius, theta,
+                    kernel, force, count);
+  }
+}
+
+// Barnes-Hut approximation of accumulateTreeForce with opening angle theta:
+// a node (leaves included) whose extent is below theta times its distance
+// from the target acts as one particle of its total mass at its center of
+// mass, with computeForce's decay applied at that distance. Needs
+// QuadTree::summarize().
+inline Vec2 accumulateTreeForceBarnesHut(const QuadTree &tree,
+                                         const Particle &target,
+                                         float cullRadius, float theta,
+                                         ForceKernelFn kernel,
+                                         int *visited = nullptr) {
+  Vec2 force(0.0f, 0.0f);
+  int count = 0;
+  if (!tree.nodes.empty() && tree.nodes[0].size() > 0)
+    barnesHutImpl(tree, 0, target, cullRadius, theta, kernel, force, count);
+  if (visited)
+    *visited += count;
+  return force;
+}
+
+// Same as accumulateTreeForce on a CellGrid: one kernel call per row of
+// cells the cull disk overlaps.
+inline Vec2 accumulateGridForce(const CellGrid &grid, const Particle &target,
+                                float cullRadius, ForceKernelFn kernel,
+                                int *visited = nullptr) {
+  Vec2 force(0.0f, 0.0f);
+  int count = 0;
+  grid.forEachRange(target.position, cullRadius, [&](int begin, int end) {
+    force += kernel(target.position, target.mass, grid.cellX.data(),
+                    grid.cellY.data(), grid.cellMass.data(), begin, end,
+                    cullRadius);
+    count += end - begin;
+  });
+  if (visited)
+    *visited += count;
+  return force;
+}
+
+// Force on target from the particles of a spatial index, overloaded so that
+// simulators can be written once for both indices. On a QuadTree this is
+// accumulateTreeForce, or its Barnes-Hut approximation if params.theta > 0.
+inline Vec2 accumulateForce(const QuadTree &tree, const Particle &target,
+                            StepParameters params, ForceKernelFn kernel,
+                            int *visited = nullptr) {
+  if (params.theta > 0.0f)
+    return accumulateTreeForceBarnesHut(tree, target, params.cullRadius,
+                                        params.theta, kernel, visited);
+  return accumulateTreeForce(tree, target, params.cullRadius, kernel, visited);
+}
+
+// CellGrid has no node summaries, so it always evaluates exactly
+inline Vec2 accumulateForce(const CellGrid &grid, const Particle &target,
+                            StepParameters params, ForceKernelFn kernel,
+                            int *visited = nullptr) {
+  return accumulateGridForce(grid, target, params.cullRadius, kernel, visited);
+}
+
+#endif
@@ -0,0 +1,309 @@
+// Device side of GpuStepper, see gpu-forces.h. Built with --fmad=false, so
+// that the force arithmetic rounds like the host's computeForce.
+
+#include "arena.h"
+#include "gpu-forces.h"
+#include <cuda_runtime.h>
+
+namespace {
+
+// deepest tree the per-thread traversal stack holds; the host builds deeper
+// trees only for near-coincident clusters
+const int GpuMaxTreeDepth = 96;
+const int GpuBlockSize = 128;
+
+// GpuTree in device memory
+struct DeviceTree {
+  const GpuNode *nodes;
+  int numNodes;
+  const float *x, *y, *mass;
+  const float *nodeMass, *nodeCenterOfMass;
+};
+
+template <typename T> struct DeviceBuffer {
+  T *ptr = nullptr;
+  size_t capacity = 0;
+
+  // grows with BufferSlack headroom like the host buffers; if the
+  // allocation fails the buffer is left empty
+  cudaError_t reserve(size_t n) {
+    if (capacity >= n)
+      return cudaSuccess;
+    cudaFree(ptr);
+    ptr = nullptr;
+    capacity = 0;
+    const size_t grown = (size_t)(n * BufferSlack);
+    cudaError_t err = cudaMalloc(&ptr, grown * sizeof(T));
+    if (err != cudaSuccess) {
+      ptr = nullptr;
+      return err;
+    }
+    capacity = grown;
+    return cudaSuccess;
+  }
+
+  cudaError_t upload(const T *src, size_t n, cudaStream_t stream) {
+    cudaError_t err = reserve(n);
+    if (err != cudaSuccess || n == 0)
+      return err;
+    return cudaMemcpyAsync(ptr, src, n * sizeof(T), cudaMemcpyHostToDevice,
+                           stream);
+  }
+
+  ~DeviceBuffer() { cudaFree(ptr); }
+};
+
+struct TreeBuffers {
+  DeviceBuffer<GpuNode> nodes;
+  // the SoA arrays carry QuadTreeSoAPadding, which the device never reads
+  DeviceBuffer<float> x, y, mass, nodeMass, nodeCenterOfMass;
+
+  // returns the first error, d is only usable without one
+  cudaError_t upload(const GpuTree &tree, cudaStream_t stream,
+                     DeviceTree &d) {
+    cudaError_t err = nodes.upload(tree.nodes, tree.numNodes, stream);
+    if (err == cudaSuccess)
+      err = x.upload(tree.x, tree.numLeafParticles, stream);
+    if (err == cudaSuccess)
+      err = y.upload(tree.y, tree.numLeafParticles, stream);
+    if (err == cudaSuccess)
+      err = mass.upload(tree.mass, tree.numLeafParticles, stream);
+    d = {nodes.ptr, tree.numNodes, x.ptr, y.ptr, mass.ptr, nullptr, nullptr};
+    if (tree.nodeMass && err == cudaSuccess) {
+      err = nodeMass.upload(tree.nodeMass, tree.numNodes, stream);
+      if (err == cudaSuccess)
+        err = nodeCenterOfMass.upload(tree.nodeCenterOfMass,
+                                      2 * tree.numNodes, stream);
+      d.nodeMass = nodeMass.ptr;
+      d.nodeCenterOfMass = nodeCenterOfMass.ptr;
+    }
+    return err;
+  }
+};
+
+// computeForce, operation for operation
+__device__ float2 deviceComputeForce(float tx, float ty, float tm, float ax,
+                                     float ay, float am, float cullRadius) {
+  float dx = ax - tx, dy = ay - ty;
+  float dist = sqrtf(dx * dx + dy * dy);
+  if (dist < 1e-3f)
+    return make_float2(0.0f, 0.0f);
+  float inv = 1.0f / dist;
+  dx *= inv;
+  dy *= inv;
+  if (dist > cullRadius)
+    return make_float2(0.0f, 0.0f);
+  if (dist < 1e-1f)
+    dist = 1e-1f;
+  const float G = 0.01f;
+  float scale = G / (dist * dist);
+  float fx = dx * tm * am * scale, fy = dy * tm * am * scale;
+  if (dist > cullRadius * 0.75f) {
+    float decay = 1.0f - (dist - cullRadius * 0.75f) / (cullRadius * 0.25f);
+    fx *= decay;
+    fy *= decay;
+  }
+  return make_float2(fx, fy);
+}
+
+__device__ float deviceBoxPointDistance(const GpuNode &n, float px, float py) {
+  float dx = fmaxf(fmaxf(n.bminX - px, px - n.bmaxX), 0.0f);
+  float dy = fmaxf(fmaxf(n.bminY - py, py - n.bmaxY), 0.0f);
+  return sqrtf(dx * dx + dy * dy);
+}
+
+__device__ float deviceBoxPointMaxDistance(const GpuNode &n, float px,
+                                           float py) {
+  float dx = fmaxf(px - n.bminX, n.bmaxX - px);
+  float dy = fmaxf(py - n.bminY, n.bmaxY - py);
+  return sqrtf(dx * dx + dy * dy);
+}
+
+// Adds the force of tree on the target to force and the attractors
+// evaluated to count, visiting the nodes in the order of the host's
+// recursions: accumulateTreeForce, or barnesHutImpl if theta > 0. Returns
+// false if the tree is too deep.
+__device__ bool deviceTreeForce(const DeviceTree &tree, float px, float py,
+                                float pm, float cullRadius, float theta,
+                                float2 &force, float &count) {
+  if (tree.numNodes == 0 || tree.nodes[0].end == tree.nodes[0].begin)
+    return true;
+  int stack[3 * GpuMaxTreeDepth + 1];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const int n = stack[--top];
+    const GpuNode node = tree.nodes[n];
+    if (theta > 0.0f &&
+        deviceBoxPointMaxDistance(node, px, py) < cullRadius &&
+        deviceBoxPointDistance(node, px, py) > 0.0f) {
+      float cx = tree.nodeCenterOfMass[2 * n];
+      float cy = tree.nodeCenterOfMass[2 * n + 1];
+      float size = fmaxf(node.bmaxX - node.bminX, node.bmaxY - node.bminY);
+      float ex = cx - px, ey = cy - py;
+      if (size < theta * sqrtf(ex * ex + ey * ey)) {
+        float2 f = deviceComputeForce(px, py, pm, cx, cy, tree.nodeMass[n],
+                                      cullRadius);
+        force.x += f.x;
+        force.y += f.y;
+        count += 1.0f;
+        continue;
+      }
+    }
+    if (node.firstChild < 0) {
+      // one leaf at a time, like the scalar kernel
+      float2 leaf = make_float2(0.0f, 0.0f);
+      for (int i = node.begin; i < node.end; i++) {
+        float2 f = deviceComputeForce(px, py, pm, tree.x[i], tree.y[i],
+                                      tree.mass[i], cullRadius);
+        leaf.x += f.x;
+        leaf.y += f.y;
+      }
+      force.x += leaf.x;
+      force.y += leaf.y;
+      count += (float)(node.end - node.begin);
+      continue;
+    }
+    if (top + 4 > 3 * GpuMaxTreeDepth + 1)
+      return false;
+    // pushed last to first, so the first child is visited first
+    for (int c = 3; c >= 0; c--) {
+      const GpuNode &child = tree.nodes[node.firstChild + c];
+      if (child.end > child.begin &&
+          deviceBoxPointDistance(child, px, py) <= cullRadius)
+        stack[top++] = node.firstChild + c;
+    }
+  }
+  return true;
+}
+
+__global__ void localForces(DeviceTree tree, const GpuParticle *targets,
+                            int n, float cullRadius, float theta,
+                            float2 *forces, float *costs, int *failed) {
+  int j = blockIdx.x * blockDim.x + threadIdx.x;
+  if (j >= n)
+    return;
+  const GpuParticle p = targets[j];
+  float2 force = make_float2(0.0f, 0.0f);
+  float count = 0.0f;
+  if (!deviceTreeForce(tree, p.x, p.y, p.mass, cullRadius, theta, force,
+                       count))
+    *failed = 1;
+  forces[j] = force;
+  costs[j] = count;
+}
+
+// ghost forces, then updateParticle
+__global__ void ghostForcesAndIntegrate(DeviceTree ghosts,
+                                        const GpuParticle *targets, int n,
+                                        float cullRadius, float theta,
+                                        float deltaTime, const float2 *forces,
+                                        float *costs, GpuParticle *out,
+                                        int *failed) {
+  int j = blockIdx.x * blockDim.x + threadIdx.x;
+  if (j >= n)
+    return;
+  GpuParticle p = targets[j];
+  float2 force = forces[j];
+  float count = costs[j];
+  if (!deviceTreeForce(ghosts, p.x, p.y, p.mass, cullRadius, theta, force,
+                       count))
+    *failed = 1;
+  const float scale = deltaTime / p.mass;
+  p.vx += force.x * scale;
+  p.vy += force.y * scale;
+  p.x += p.vx * deltaTime;
+  p.y += p.vy * deltaTime;
+  out[j] = p;
+  costs[j] = count;
+}
+
+} // namespace
+
+struct GpuStepper::Impl {
+  cudaStream_t stream;
+  TreeBuffers local, ghost;
+  DeviceBuffer<GpuParticle> targets, updated;
+  DeviceBuffer<float2> forces;
+  DeviceBuffer<float> costs;
+  int *failed = nullptr;
+  int n = 0;
+  float cullRadius = 0.0f, theta = 0.0f;
+};
+
+GpuStepper::GpuStepper() {}
+
+GpuStepper::~GpuStepper() {
+  if (!impl)
+    return;
+  cudaFree(impl->failed);
+  cudaStreamDestroy(impl->stream);
+  delete impl;
+}
+
+bool GpuStepper::init(int localRank) {
+  int devices = 0;
+  if (cudaGetDeviceCount(&devices) != cudaSuccess || devices == 0)
+    return false;
+  if (cudaSetDevice(localRank % devices) != cudaSuccess)
+    return false;
+  impl = new Impl;
+  if (cudaStreamCreate(&impl->stream) != cudaSuccess) {
+    delete impl;
+    impl = nullptr;
+    return false;
+  }
+  return cudaMalloc(&impl->failed, sizeof(int)) == cudaSuccess;
+}
+
+bool GpuStepper::beginLocal(const GpuTree &tree, const GpuParticle *targets,
+                            int n, float cullRadius, float theta) {
+  Impl &m = *impl;
+  m.n = n;
+  m.cullRadius = cullRadius;
+  m.theta = theta;
+  DeviceTree d;
+  cudaError_t err = m.local.upload(tree, m.stream, d);
+  if (err == cudaSuccess)
+    err = m.targets.upload(targets, n, m.stream);
+  if (err == cudaSuccess)
+    err = m.forces.reserve(n);
+  if (err == cudaSuccess)
+    err = m.costs.reserve(n);
+  if (err == cudaSuccess)
+    err = m.updated.reserve(n);
+  if (err == cudaSuccess)
+    err = cudaMemsetAsync(m.failed, 0, sizeof(int), m.stream);
+  if (err != cudaSuccess)
+    return false;
+  if (n > 0)
+    localForces<<<(n + GpuBlockSize - 1) / GpuBlockSize, GpuBlockSize, 0,
+                  m.stream>>>(d, m.targets.ptr, n, cullRadius, theta,
+                              m.forces.ptr, m.costs.ptr, m.failed);
+  return cudaGetLastError() == cudaSuccess;
+}
+
+bool GpuStepper::finish(const GpuTree &ghosts, float deltaTime,
+                        GpuParticle *out, float *costs) {
+  Impl &m = *impl;
+  DeviceTree d;
+  if (m.ghost.upload(ghosts, m.stream, d) != cudaSuccess)
+    return false;
+  if (m.n > 0)
+    ghostForcesAndIntegrate<<<(m.n + GpuBlockSize - 1) / GpuBlockSize,
+                              GpuBlockSize, 0, m.stream>>>(
+        d, m.targets.ptr, m.n, m.cullRadius, m.theta, deltaTime,
+        m.forces.ptr, m.costs.ptr, m.updated.ptr, m.failed);
+  int failed = 0;
+  cudaMemcpyAsync(&failed, m.failed, sizeof(int), cudaMemcpyDeviceToHost,
+                  m.stream);
+  if (cudaStreamSynchronize(m.stream) != cudaSuccess || failed)
+    return false;
+  if (m.n == 0)
+    return true;
+  cudaMemcpyAsync(out, m.updated.ptr, m.n * sizeof(GpuParticle),
+                  cudaMemcpyDeviceToHost, m.stream);
+  cudaMemcpyAsync(costs, m.costs.ptr, m.n * sizeof(float),
+                  cudaMemcpyDeviceToHost, m.stream);
+  return cudaStreamSynchronize(m.stream) == cudaSuccess;
+}
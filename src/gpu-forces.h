@@ -0,0 +1,116 @@
+#ifndef GPU_FORCES_H
+#define GPU_FORCES_H
+
+#ifndef __CUDACC__
+#include "quad-tree.h"
+#include <cstddef>
+#endif
+
+// -gpu: v2's force evaluation and integration on the rank's GPU. The host
+// still builds the trees; every step uploads the linearized local tree (node
+// pool and SoA leaf storage) with the local particles, and later the ghost
+// tree, and the device traverses both per particle, exactly or Barnes-Hut
+// like force-kernel.h, and integrates like updateParticle. The device code
+// is in gpu-forces.cu and only built by the CUDA target (NBODY_CUDA); other
+// builds get a GpuStepper whose init() fails, which keeps v2 on the host.
+
+// device-side mirrors of FlatQuadTreeNode and Particle, with the same layout
+struct GpuNode {
+  float bminX, bminY, bmaxX, bmaxY;
+  int firstChild, begin, end;
+};
+
+struct GpuParticle {
+  int id;
+  float mass, x, y, vx, vy;
+};
+
+// A QuadTree as the device needs it, in host memory. nodeMass and
+// nodeCenterOfMass (x, y pairs) are only needed for Barnes-Hut.
+struct GpuTree {
+  const GpuNode *nodes = nullptr;
+  int numNodes = 0;
+  const float *x = nullptr, *y = nullptr, *mass = nullptr;
+  int numLeafParticles = 0;
+  const float *nodeMass = nullptr, *nodeCenterOfMass = nullptr;
+};
+
+// One rank's device and its buffers, which are reused across steps.
+class GpuStepper {
+public:
+#ifdef NBODY_CUDA
+  GpuStepper();
+  ~GpuStepper();
+  GpuStepper(const GpuStepper &) = delete;
+  GpuStepper &operator=(const GpuStepper &) = delete;
+
+  // Picks device localRank modulo the node's devices, so that the ranks of a
+  // node spread over its GPUs. Returns false if there is none.
+  bool init(int localRank);
+
+  // Uploads tree and the n targets and starts their forces from tree
+  // without waiting for them, so the host can progress MPI meanwhile.
+  // Returns false if the device could not hold them, the caller then
+  // evaluates on the host from here on.
+  bool beginLocal(const GpuTree &tree, const GpuParticle *targets, int n,
+                  float cullRadius, float theta);
+
+  // Adds the forces from ghosts (numNodes 0 for none), integrates and
+  // downloads the n updated particles into out and the attractors evaluated
+  // per target into costs. Returns false if the device failed or a tree was
+  // deeper than the device traversal supports, out and costs are then
+  // unchanged and the caller evaluates the step on the host.
+  bool finish(const GpuTree &ghosts, float deltaTime, GpuParticle *out,
+              float *costs);
+
+private:
+  struct Impl;
+  Impl *impl = nullptr;
+#else
+  bool init(int) { return false; }
+  bool beginLocal(const GpuTree &, const GpuParticle *, int, float, float) {
+    return false;
+  }
+  bool finish(const GpuTree &, float, GpuParticle *, float *) {
+    return false;
+  }
+#endif
+};
+
+#ifndef __CUDACC__
+static_assert(sizeof(GpuNode) == sizeof(FlatQuadTreeNode) &&
+                  offsetof(GpuNode, firstChild) ==
+                      offsetof(FlatQuadTreeNode, firstChild),
+              "GpuNode must mirror FlatQuadTreeNode");
+static_assert(sizeof(GpuParticle) == sizeof(Particle) &&
+                  offsetof(GpuParticle, x) == offsetof(Particle, position) &&
+                  offsetof(GpuParticle, vx) == offsetof(Particle, velocity),
+              "GpuParticle must mirror Particle");
+
+// tree without copies; summaries only after QuadTree::summarize()
+inline GpuTree gpuTreeView(const QuadTree &tree, bool summaries) {
+  GpuTree view;
+  view.nodes = reinterpret_cast<const GpuNode *>(tree.nodes.data());
+  view.numNodes = (int)tree.nodes.size();
+  view.x = tree.leafX.data();
+  view.y = tree.leafY.data();
+  view.mass = tree.leafMass.data();
+  view.numLeafParticles = (int)tree.leafParticles.size();
+  if (summaries) {
+    view.nodeMass = tree.nodeMass.data();
+    view.nodeCenterOfMass =
+        reinterpret_cast<const float *>(tree.nodeCenterOfMass.data());
+  }
+  return view;
+}
+
+inline const GpuParticle *gpuParticles(const Particle *particles) {
+  return reinterpret_cast<const GpuParticle *>(particles);
+}
+
+inline GpuParticle *gpuParticles(Particle *particles) {
+  return reinterpret_cast<GpuParticle *>(particles);
+}
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+#include "alloc-counter.h"
+#include "cell-grid.h"
+#include "common.h"
+#include "force-kernel.h"
+#include "particle-io.h"
+#include "quad-tree.h"
+#include "timing.h"
+#include <cstdio>
+#include <cstdlib>
+
+// Single-process microbenchmarks for the spatial indices and force kernels,
+// no MPI needed. Every run prints one CSV row per measurement:
+//   scene,benchmark,variant,particles,ns_per_particle,neighbors_per_sec,allocs
+// ns_per_particle is per built / queried / updated particle, allocs counts
+// heap allocations per repetition once the buffers are warm, see
+// alloc-counter.h.
+//
+// usage: microbench [-dir src/benchmark-files] [-reps 5] [-queries 2000]
+//                   [scene ...]
+
+struct Scene {
+  const char *name;
+  float spaceSize;
+};
+
+// same scenes and space sizes as checker.py
+static const Scene Scenes[] = {
+    {"random-50000", 500.0f}, {"corner-50000", 500.0f},
+    {"repeat-10000", 100.0f}, {"sparse-50000", 5.0f},
+    {"sparse-200000", 20.0f},
+};
+
+static void report(const char *scene, const char *benchmark,
+                   const std::string &variant, size_t particles,
+                   double seconds, double neighbors, long long allocs) {
+  printf("%s,%s,%s,%zu,%.3f,%.4g,%lld\n", scene, benchmark, variant.c_str(),
+         particles, seconds * 1e9 / std::max(particles, (size_t)1),
+         seconds > 0.0 ? neighbors / seconds : 0.0, allocs);
+  fflush(stdout);
+}
+
+// Runs f() once to warm up, then reps times. Returns the best time of one
+// repetition and leaves the allocations of the last one in allocs.
+template <typename F> double measure(int reps, long long &allocs, F &&f) {
+  f();
+  double best = 1e30;
+  for (int r = 0; r < reps; r++) {
+    long long before = heapAllocations();
+    Timer timer;
+    f();
+    best = std::min(best, timer.elapsed());
+    allocs = heapAllocations() - before;
+  }
+  return best;
+}
+
+static void benchScene(const Scene &scene, const std::string &dir, int reps,
+                       int numQueries) {
+  std::vector<Particle> particles;
+  loadParticles(dir + "/" + scene.name + "-init.txt", particles);
+  const size_t n = particles.size();
+  const StepParameters params = getBenchmarkStepParams(scene.spaceSize);
+  const float cull = params.cullRadius;
+  long long allocs = 0;
+
+  QuadTree tree, mortonTree;
+  CellGrid grid;
+  double t = measure(reps, allocs,
+                     [&] { QuadTree::buildQuadTree(particles, tree); });
+  report(scene.name, "build", "quadtree", n, t, 0.0, allocs);
+  // refit to the unchanged particles, which always succeeds
+  t = measure(reps, allocs, [&] { tree.refit(particles); });
+  report(scene.name, "build", "refit", n, t, 0.0, allocs);
+  QuadTree::buildQuadTree(particles, tree);
+  t = measure(reps, allocs,
+              [&] { QuadTree::buildQuadTreeMorton(particles, mortonTree); });
+  report(scene.name, "build", "morton", n, t, 0.0, allocs);
+  t = measure(reps, allocs,
+              [&] { CellGrid::build(particles, grid, cull * 0.5f); });
+  report(scene.name, "build", "cellgrid", n, t, 0.0, allocs);
+
+  // queries start from an even sample of the particles
+  std::vector<Particle> targets;
+  const size_t stride = std::max(n / std::max(numQueries, 1), (size_t)1);
+  for (size_t i = 0; i < n; i += stride)
+    targets.push_back(particles[i]);
+
+  std::vector<Particle> neighbors;
+  for (float scale : {0.25f, 0.5f, 1.0f}) {
+    const float radius = cull * scale;
+    double found = 0.0;
+    t = measure(reps, allocs, [&] {
+      found = 0.0;
+      for (auto &p : targets) {
+        tree.getParticles(neighbors, p.position, radius);
+        found += neighbors.size();
+      }
+    });
+    char variant[32];
+    snprintf(variant, sizeof(variant), "quadtree-r%.2f", scale);
+    report(scene.name, "getParticles", variant, targets.size(), t, found,
+           allocs);
+    t = measure(reps, allocs, [&] {
+      found = 0.0;
+      for (auto &p : targets) {
+        grid.getParticles(neighbors, p.position, radius);
+        found += neighbors.size();
+      }
+    });
+    snprintf(variant, sizeof(variant), "cellgrid-r%.2f", scale);
+    report(scene.name, "getParticles", variant, targets.size(), t, found,
+           allocs);
+  }
+
+  // neighbors_per_sec counts attractors evaluated
+  const ForceKernelISA best = detectForceKernelISA();
+  for (ForceKernelISA isa : {ForceKernelISA::Scalar, ForceKernelISA::AVX2,
+                             ForceKernelISA::AVX512}) {
+    if ((int)isa > (int)best)
+      continue;
+    ForceKernelFn kernel = selectForceKernel(isa);
+    Vec2 sink(0.0f, 0.0f);
+    int visited = 0;
+    t = measure(reps, allocs, [&] {
+      visited = 0;
+      for (auto &p : targets)
+        sink += accumulateForce(tree, p, params, kernel, &visited);
+    });
+    report(scene.name, "force", std::string("quadtree-") + forceKernelName(isa),
+           targets.size(), t, visited, allocs);
+    t = measure(reps, allocs, [&] {
+      visited = 0;
+      for (auto &p : targets)
+        sink += accumulateForce(grid, p, params, kernel, &visited);
+    });
+    report(scene.name, "force", std::string("cellgrid-") + forceKernelName(isa),
+           targets.size(), t, visited, allocs);
+    if (sink.x == 12345.0f)
+      printf("#\n"); // keep the sums alive
+  }
+
+  std::vector<Particle> updated(n);
+  const Vec2 force(1e-3f, -1e-3f);
+  t = measure(reps, allocs, [&] {
+    for (size_t i = 0; i < n; i++)
+      updated[i] = updateParticle(particles[i], force, params.deltaTime);
+  });
+  report(scene.name, "updateParticle", "-", n, t, 0.0, allocs);
+}
+
+int main(int argc, char *argv[]) {
+  std::string dir = "src/benchmark-files";
+  int reps = 5, numQueries = 2000;
+  std::vector<std::string> only;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-dir") == 0 && i + 1 < argc)
+      dir = argv[++i];
+    else if (strcmp(argv[i], "-reps") == 0 && i + 1 < argc)
+      reps = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-queries") == 0 && i + 1 < argc)
+      numQueries = atoi(argv[++i]);
+    else
+      only.push_back(argv[i]);
+  }
+
+  printf("scene,benchmark,variant,particles,ns_per_particle,"
+         "neighbors_per_sec,allocs\n");
+  for (const Scene &scene : Scenes) {
+    if (!only.empty() &&
+        std::find(only.begin(), only.end(), scene.name) == only.end())
+      continue;
+    benchScene(scene, dir, reps, numQueries);
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "arena.h"
+#include "common.h"
+#include <cstdint>
+
+// Morton (Z-curve) keys use 16 bits per axis. Bit pairs are ordered (y, x)
+// from the top, so the two most significant bits of a key equal the quadrant
+// index used by QuadTreeNode::children, and every quadtree cell at depth d is
+// a contiguous key range sharing the top 2 * d bits.
+const int MortonBitsPerAxis = 16;
+
+inline uint32_t mortonExpandBits(uint32_t v) {
+  v &= 0x0000ffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+inline uint32_t mortonQuantize(float v, float vmin, float scale) {
+  float q = (v - vmin) * scale;
+  if (!(q > 0.0f))
+    return 0;
+  const float qmax = (float)((1 << MortonBitsPerAxis) - 1);
+  return q >= qmax ? (uint32_t)qmax : (uint32_t)q;
+}
+
+// scale maps a coordinate offset from bmin to the 16 bit grid
+inline Vec2 mortonScale(Vec2 bmin, Vec2 bmax) {
+  const float cells = (float)(1 << MortonBitsPerAxis);
+  Vec2 extent = bmax - bmin;
+  return Vec2(extent.x > 0.0f ? cells / extent.x : 0.0f,
+              extent.y > 0.0f ? cells / extent.y : 0.0f);
+}
+
+inline uint32_t mortonKey(Vec2 p, Vec2 bmin, Vec2 scale) {
+  return mortonExpandBits(mortonQuantize(p.x, bmin.x, scale.x)) |
+         (mortonExpandBits(mortonQuantize(p.y, bmin.y, scale.y)) << 1);
+}
+
+// Sorts particles by Morton key with an LSD radix sort (8 bits per pass).
+// Buffers are kept between calls so repeated sorts do not allocate.
+class MortonSorter {
+public:
+  // sorted keys, keys[i] belongs to the i-th particle of the sorted order
+  std::vector<uint32_t> keys;
+  // order[i] is the input index of the i-th particle of the sorted order
+  std::vector<int> order;
+
+  void sort(const std::vector<Particle> &particles, Vec2 bmin, Vec2 bmax) {
+    const size_t n = particles.size();
+    Vec2 scale = mortonScale(bmin, bmax);
+    reserveWithSlack(keys, n);
+    reserveWithSlack(order, n);
+    reserveWithSlack(keysTmp, n);
+    reserveWithSlack(orderTmp, n);
+    keys.resize(n);
+    order.resize(n);
+    keysTmp.resize(n);
+    orderTmp.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      keys[i] = mortonKey(particles[i].position, bmin, scale);
+      order[i] = (int)i;
+    }
+
+    for (int shift = 0; shift < 32; shift += 8) {
+      size_t counts[256] = {0};
+      for (size_t i = 0; i < n; i++)
+        counts[(keys[i] >> shift) & 0xff]++;
+      // every key has the same digit, nothing to do for this pass
+      if (n == 0 || counts[(keys[0] >> shift) & 0xff] == n)
+        continue;
+      size_t acc = 0;
+      for (int d = 0; d < 256; d++) {
+        size_t c = counts[d];
+        counts[d] = acc;
+        acc += c;
+      }
+      for (size_t i = 0; i < n; i++) {
+        size_t dst = counts[(keys[i] >> shift) & 0xff]++;
+        keysTmp[dst] = keys[i];
+        orderTmp[dst] = order[i];
+      }
+      keys.swap(keysTmp);
+      order.swap(orderTmp);
+    }
+  }
+
+  // writes particles in sorted order to out
+  void gather(const std::vector<Particle> &particles,
+              std::vector<Particle> &out) const {
+    reserveWithSlack(out, order.size());
+    out.resize(order.size());
+    for (size_t i = 0; i < order.size(); i++)
+      out[i] = particles[order[i]];
+  }
+
+private:
+  std::vector<uint32_t> keysTmp;
+  std::vector<int> orderTmp;
+};
+
+// Reorders particles along the Z-curve of their bounding box.
+inline void sortByMorton(std::vector<Particle> &particles, MortonSorter &sorter,
+                         std::vector<Particle> &scratch) {
+  Vec2 bmin(1e30f, 1e30f);
+  Vec2 bmax(-1e30f, -1e30f);
+  for (auto &p : particles) {
+    bmin.x = fminf(bmin.x, p.position.x);
+    bmin.y = fminf(bmin.y, p.position.y);
+    bmax.x = fmaxf(bmax.x, p.position.x);
+    bmax.y = fmaxf(bmax.y, p.position.y);
+  }
+  sorter.sort(particles, bmin, bmax);
+  sorter.gather(particles, scratch);
+  particles.swap(scratch);
+}
+
+#endif
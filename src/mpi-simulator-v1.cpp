@@ -1,7 +1,18 @@
+#include "alloc-counter.h"
+#include "arena.h"
+#include "block-timestep.h"
+#include "checkpoint.h"
 #include "common.h"
+#include "distributed-tree.h"
+#include "dual-tree.h"
+#include "force-kernel.h"
 #include "mpi.h"
+#include "neighbor-list.h"
+#include "parallel-io.h"
+#include "profiler.h"
 #include "quad-tree.h"
 #include "timing.h"
+#include "wire-format.h"
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -9,6 +20,9 @@
 #define DEF_TAG 0
 #define COORDINATOR 0
 #define INT_TYPES_PER_PARTICLE 6 // 1 int, 1 float, 2x vec2 (2 floats)
+#define SIMULATE_CHUNK 64 // particles per thread pool task
+#define GRID_CELL_SCALE 0.5f // CellGrid cell size relative to cullRadius
+#define ALLOC_WARMUP_ITERATIONS 2 // iterations before allocations are counted
 
 static int pid;
 static int nproc;
@@ -18,30 +32,141 @@ static MPI_Status status;
 /**
  * Simulates one iteration for a subrange of particles, 
  * putting the result in newParticles. 
- * @param[in] quadTree The quad tree holding all data structures.
+ * @param[in] index The QuadTree or CellGrid over all particles.
  * @param[in] particles The complete list of particles.
  * @param[out] newParticles The empty particle list to be filled in.
  * @param[in] params idk
+ * @param[in] kernel The force accumulation kernel, see force-kernel.h.
+ * @param[in] pool The rank's threads, each takes chunks of the subrange.
+ * @param[out] visited If set, visited[worker] counts the attractors each
+ *             worker evaluated.
  */
-void simulateStep(const QuadTree &quadTree,
+template <typename Index>
+void simulateStep(const Index &index,
                   const std::vector<Particle> &particles,
                   std::vector<Particle> &newParticles, StepParameters params,
-                  size_t start, size_t end) {
+                  size_t start, size_t end, ForceKernelFn kernel,
+                  ThreadPool &pool, double *visited = nullptr) {
   /* newParticles should be empty */
   // assert(newParticles.size() == 0);
-  for (size_t j = start; j < end; j++) {
+  pool.parallelFor(start, end, SIMULATE_CHUNK, [&](size_t b, size_t e, int w) {
+    /* without visited the kernels skip counting */
+    int count = 0;
+    int *counter = visited ? &count : nullptr;
+    for (size_t j = b; j < e; j++) {
       auto p = particles[j];
       Vec2 force = Vec2(0.0f, 0.0f);
-      std::vector<Particle> neighbors;
-      quadTree.getParticles(neighbors, p.position, params.cullRadius);
-      /* Iterate through nearby particles and accumulate new force */
-      for (size_t i = 0; i < neighbors.size(); i++) {
-        Particle p1 = neighbors[i];
-        force += computeForce(p, p1, params.cullRadius);
-      }
+      /* Accumulate force from nearby particles straight from the tree */
+      force += accumulateForce(index, p, params, kernel, counter);
       /* Update force */
       newParticles[j-start] = updateParticle(p, force, params.deltaTime);
     }
+    if (visited)
+      visited[w] += count;
+  });
+}
+
+/**
+ * simulateStep with the forces taken from Verlet lists over particles
+ * instead of tree queries.
+ */
+void simulateStepVerlet(const VerletList &list,
+                        const std::vector<Particle> &particles,
+                        std::vector<Particle> &newParticles,
+                        StepParameters params, size_t start, size_t end,
+                        ForceKernelFn kernel, ThreadPool &pool,
+                        double *visited = nullptr) {
+  pool.parallelFor(start, end, SIMULATE_CHUNK, [&](size_t b, size_t e, int w) {
+    int count = 0;
+    int *counter = visited ? &count : nullptr;
+    for (size_t j = b; j < e; j++) {
+      Vec2 force = list.accumulateForce(particles, j, params.cullRadius,
+                                        kernel, counter);
+      newParticles[j - start] =
+          updateParticle(particles[j], force, params.deltaTime);
+    }
+    if (visited)
+      visited[w] += count;
+  });
+}
+
+/**
+ * simulateStep with -timestep-levels: only the particles of the subrange
+ * active at step i get their forces and are kicked by their own steps, then
+ * every particle of the subrange drifts by one step.
+ * @param[in] maxSpeed The speed of the fastest particle of any rank.
+ * @param[in] forceOf forceOf(j, count) returns the force on particles[j]
+ *            and adds the attractors evaluated to *count if count is set.
+ * @param[out] active The indices j - start of the active particles.
+ */
+template <typename ForceFn>
+void simulateStepActive(BlockTimesteps &steps, int i, float maxSpeed,
+                        ForceFn forceOf,
+                        const std::vector<Particle> &particles,
+                        std::vector<Particle> &newParticles,
+                        StepParameters params, size_t start, size_t end,
+                        std::vector<int> &active, ThreadPool &pool,
+                        double *visited = nullptr) {
+  steps.collectActive(i, active);
+  std::copy(particles.begin() + start, particles.begin() + end,
+            newParticles.begin());
+  pool.parallelFor(0, active.size(), SIMULATE_CHUNK,
+                   [&](size_t b, size_t e, int w) {
+    int count = 0;
+    int *counter = visited ? &count : nullptr;
+    for (size_t k = b; k < e; k++) {
+      const size_t j = active[k];
+      Vec2 force = forceOf(start + j, counter);
+      newParticles[j] =
+          steps.kick(j, particles[start + j], force, i, params, maxSpeed);
+    }
+    if (visited)
+      visited[w] += count;
+  });
+  for (auto &p : newParticles)
+    p.position += p.velocity * params.deltaTime;
+}
+
+/* buffers of -dual, kept across iterations */
+struct DualTreeState {
+  QuadTree targetTree;
+  DualTreeForces forces;
+  std::vector<Particle> targets;
+  std::vector<int> indexOfId;
+};
+
+/**
+ * simulateStep with the forces evaluated leaf against leaf: the targets
+ * particles[start, end) get a tree of their own, whose leaves are then
+ * matched against the leaves of tree.
+ */
+void simulateStepDual(const QuadTree &tree, DualTreeState &dual,
+                      const std::vector<Particle> &particles,
+                      std::vector<Particle> &newParticles,
+                      StepParameters params, size_t start, size_t end,
+                      ForceKernelFn kernel, ThreadPool &pool,
+                      double *visited = nullptr) {
+  dual.targets.assign(particles.begin() + start, particles.begin() + end);
+  QuadTree::buildQuadTree(dual.targets, dual.targetTree, pool);
+  dual.forces.begin(dual.targetTree, pool);
+  dual.forces.accumulate(dual.targetTree, tree, 0, dual.forces.numLeaves(),
+                         params.cullRadius, kernel, pool);
+
+  int maxId = -1;
+  for (auto &p : dual.targets)
+    maxId = std::max(maxId, p.id);
+  dual.indexOfId.resize(maxId + 1);
+  for (size_t j = start; j < end; j++)
+    dual.indexOfId[particles[j].id] = (int)j;
+  double count = 0.0;
+  dual.forces.finish(dual.targetTree, [&](int slot, Vec2 force, float cost) {
+    size_t j = dual.indexOfId[dual.targetTree.leafParticles[slot].id];
+    newParticles[j - start] =
+        updateParticle(particles[j], force, params.deltaTime);
+    count += cost;
+  });
+  if (visited)
+    visited[0] += count;
 }
 
 int main(int argc, char *argv[]) {
@@ -53,8 +178,9 @@ int main(int argc, char *argv[]) {
 
 /* used for send and recv */
   assert(sizeof(int) == 4 && sizeof(float) == 4);
-  // Initialize MPI
-  MPI_Init(&argc, &argv);
+  // Initialize MPI, only the main thread of each rank communicates
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   // Get process rank
   MPI_Comm_rank(MPI_COMM_WORLD, &pid);
   // Get total number of processes specificed at start of run
@@ -62,25 +188,40 @@ int main(int argc, char *argv[]) {
 
   StartupOptions options = parseOptions(argc, argv);
   StepParameters stepParams = getBenchmarkStepParams(options.spaceSize);
-
-  MPI_Get_processor_name(hostname, &len);
-  if (pid == COORDINATOR) {
-    loadFromFile(options.inputFile, particles);
-    num_particles = particles.size();
-    waiting = false;
+  stepParams.theta = options.theta;
+  ForceKernelFn kernel =
+      selectForceKernel(parseForceKernelISA(options.forceKernel));
+  /* checkpoints hold particles only, not the levels and phases of
+     -timestep-levels, so a restart could not resume those steps */
+  if (options.restartStep > 0 && options.timestepLevels > 0 &&
+      !options.distributedTree) {
+    if (pid == COORDINATOR)
+      fprintf(stderr, "-restart is not supported with -timestep-levels\n");
+    MPI_Finalize();
+    return 1;
   }
 
-  /* broadcast size of particle list */
-  MPI_Bcast(&num_particles, 1, MPI_INT, COORDINATOR, MPI_COMM_WORLD);
+  MPI_Get_processor_name(hostname, &len);
+  waiting = false;
 
+  /* every rank reads its share of the input file, then the shares (in id
+     order across ranks) are combined on every rank */
+  std::vector<Particle> share;
+  loadParticlesDistributed(options.inputFile, share, MPI_COMM_WORLD);
+  int share_bytes = share.size() * sizeof(Particle);
+  std::vector<int> share_counts(nproc), share_displ(nproc);
+  MPI_Allgather(&share_bytes, 1, MPI_INT, share_counts.data(), 1, MPI_INT,
+                MPI_COMM_WORLD);
+  int total_bytes = 0;
+  for (int id = 0; id < nproc; id++) {
+    share_displ[id] = total_bytes;
+    total_bytes += share_counts[id];
+  }
+  num_particles = total_bytes / sizeof(Particle);
   particles.resize(num_particles);
-
-  MPI_Bcast(
-    particles.data(), 
-    sizeof(Particle) * num_particles,
-    MPI_BYTE,
-    COORDINATOR,
-    MPI_COMM_WORLD);
+  MPI_Allgatherv(share.data(), share_bytes, MPI_BYTE, particles.data(),
+                 share_counts.data(), share_displ.data(), MPI_BYTE,
+                 MPI_COMM_WORLD);
 
   /* all nodes create particle array for broadcast */
   // uint32_t raw_particle_list[num_particles * INT_TYPES_PER_PARTICLE]; // global particle data
@@ -88,8 +229,7 @@ int main(int argc, char *argv[]) {
 
   // Don't change the timeing for totalSimulationTime.
   MPI_Barrier(MPI_COMM_WORLD);
-  int displ[nproc];
-  int recv_count[nproc];
+  std::vector<int> displ(nproc), recv_count(nproc);
   int bsize = num_particles / nproc;
   int r = num_particles % bsize;
   for (int id = 0; id < nproc; id++) { 
@@ -111,36 +251,231 @@ int main(int argc, char *argv[]) {
     }
   }
   newParticles.resize(recv_count[pid]/ sizeof(Particle));
+  /* reused across iterations so the tree buffers are only allocated once */
+  QuadTree tree;
+  ThreadPool pool(options.numThreads);
+  CellGrid cells;
+  const float cell_size = stepParams.cullRadius * GRID_CELL_SCALE;
+  bool use_grid =
+      useCellGrid(options.spatialIndex, particles, stepParams.cullRadius);
+  /* -dtree: every rank only builds the subtrees of the particles it owns */
+  DistributedTree dtree;
+  std::vector<Particle> owned;
+  if (options.distributedTree)
+    owned.assign(particles.begin() + start, particles.begin() + end);
+  PhaseProfiler profiler(options.profile, options.numIterations);
+  /* -verlet: forces from neighbor lists, rebuilt with the tree only once a
+     particle has moved half the skin; exact like the per-step query */
+  VerletList verlet(options.verletSkin * stepParams.cullRadius);
+  bool use_verlet = options.verletSkin > 0.0f;
+  if (use_verlet)
+    use_grid = false;
+  /* -timestep-levels: block timesteps for the own slice. Not with -dtree,
+     and since only some particles get forces, without the Z-curve order of
+     -morton and the leaf pairs of -dual. */
+  BlockTimesteps timesteps(
+      options.distributedTree ? 0 : options.timestepLevels,
+      options.timestepAccuracy);
+  timesteps.resize(end - start);
+  std::vector<int> active;
+  const bool use_morton = options.mortonOrder && !timesteps.isEnabled();
+  /* -dual: exact forces from the tree, leaf against leaf */
+  DualTreeState dual;
+  const bool use_dual = options.dualTree && stepParams.theta == 0.0f &&
+                        !timesteps.isEnabled();
+  /* every rank gathers only the positions of the others unless the
+     exchange reorders the particles (-morton) or moves whole ones (-wire
+     full); ids, masses and the velocities of other ranks' particles stay
+     put. */
+  const bool gather_positions =
+      !use_morton &&
+      parseWireFormat(options.wireFormat) != WireFormat::Full;
+  MPI_Datatype position_type = createParticleFieldsType(false);
+  std::vector<int> particle_displ(nproc), particle_count(nproc);
+  for (int id = 0; id < nproc; id++) {
+    particle_displ[id] = displ[id] / sizeof(Particle);
+    particle_count[id] = recv_count[id] / sizeof(Particle);
+  }
+  std::vector<double> visited(pool.size());
+  double *visited_out = profiler.isEnabled() ? visited.data() : nullptr;
+  /* -checkpoint: every rank snapshots the particles it writes at the end */
+  CheckpointWriter checkpoints(options.checkpointFile, MPI_COMM_WORLD);
+  const int interval = options.checkpointInterval;
+  /* -restart: the loaded snapshot is the state after first_step steps */
+  const int first_step = options.restartStep;
   Timer totalSimulationTimer;
 
 
-  for (int i = 0; i < options.numIterations; i++) {
+  long long allocations = 0;
+  for (int i = first_step; i < options.numIterations; i++) {
+    profiler.nextIteration();
+    /* the buffers have reached their steady-state sizes by now */
+    if (i - first_step == ALLOC_WARMUP_ITERATIONS)
+      allocations = heapAllocations();
+    if (interval > 0 && i > first_step && i % interval == 0) {
+      if (options.distributedTree)
+        checkpoints.write(owned.data(), owned.size(), num_particles, i);
+      else
+        checkpoints.write(particles.data() + start, end - start,
+                          num_particles, i);
+    }
     /* coordinator sends particle data to all nodes */
-    QuadTree tree;
-    QuadTree::buildQuadTree(particles, tree);
-    simulateStep(tree, particles, newParticles, stepParams, start, end);
-    /* send newParticles to master */
+    if (options.distributedTree) {
+      /* the build already shares every rank's particles */
+      profiler.begin(Phase::Build);
+      dtree.build(owned, tree, MPI_COMM_WORLD);
+      if (stepParams.theta > 0.0f)
+        tree.summarize();
+      profiler.end(Phase::Build);
+      profiler.begin(Phase::Force);
+      reserveWithSlack(newParticles, dtree.ownedEnd - dtree.ownedBegin);
+      newParticles.resize(dtree.ownedEnd - dtree.ownedBegin);
+      simulateStep(tree, tree.leafParticles, newParticles, stepParams,
+                   dtree.ownedBegin, dtree.ownedEnd, kernel, pool,
+                   visited_out);
+      owned.swap(newParticles);
+      profiler.count(Counter::ForceEvaluations, owned.size());
+      profiler.end(Phase::Force);
+      continue;
+    }
 
-    
-    MPI_Allgatherv(
-      newParticles.data(), 
-      newParticles.size() * sizeof(Particle), 
-      MPI_BYTE, 
-      particles.data(), 
-      recv_count,
-      displ, 
-      MPI_BYTE,
-      MPI_COMM_WORLD
-    );
+    profiler.begin(Phase::Build);
+    if (use_verlet) {
+      if (verlet.needsRebuild(particles)) {
+        QuadTree::buildQuadTree(particles, tree, pool);
+        profiler.count(Counter::TreeRebuilds, 1);
+        /* too many pairs for the lists: query every step from here on */
+        use_verlet = verlet.build(tree, particles, start, end,
+                                  stepParams.cullRadius, pool);
+      }
+    } else if (use_grid) {
+      CellGrid::build(particles, cells, cell_size);
+    } else {
+      /* -refit: same particles as last step, the old tree still fits */
+      bool rebuilt = !(options.refitTree && tree.refit(particles));
+      if (rebuilt && use_morton)
+        QuadTree::buildQuadTreeMorton(particles, tree);
+      else if (rebuilt)
+        QuadTree::buildQuadTree(particles, tree, pool);
+      if (rebuilt)
+        profiler.count(Counter::TreeRebuilds, 1);
+    }
+    if (!use_grid && !use_verlet && stepParams.theta > 0.0f)
+      tree.summarize();
+    profiler.end(Phase::Build);
+
+    profiler.begin(Phase::Force);
+    if (timesteps.isEnabled()) {
+      /* the own slice has every rank's velocities of its particles */
+      float max_speed = 0.0f;
+      for (size_t j = start; j < end; j++)
+        max_speed = std::max(max_speed, particles[j].velocity.length());
+      MPI_Allreduce(MPI_IN_PLACE, &max_speed, 1, MPI_FLOAT, MPI_MAX,
+                    MPI_COMM_WORLD);
+      const float cull = stepParams.cullRadius;
+      if (use_verlet) {
+        simulateStepActive(
+            timesteps, i, max_speed,
+            [&](size_t j, int *count) {
+              return verlet.accumulateForce(particles, j, cull, kernel, count);
+            },
+            particles, newParticles, stepParams, start, end, active, pool,
+            visited_out);
+      } else if (use_grid) {
+        simulateStepActive(
+            timesteps, i, max_speed,
+            [&](size_t j, int *count) {
+              return accumulateForce(cells, particles[j], stepParams, kernel,
+                                     count);
+            },
+            particles, newParticles, stepParams, start, end, active, pool,
+            visited_out);
+      } else {
+        simulateStepActive(
+            timesteps, i, max_speed,
+            [&](size_t j, int *count) {
+              return accumulateForce(tree, particles[j], stepParams, kernel,
+                                     count);
+            },
+            particles, newParticles, stepParams, start, end, active, pool,
+            visited_out);
+      }
+      profiler.count(Counter::ForceEvaluations, active.size());
+    } else if (use_verlet) {
+      simulateStepVerlet(verlet, particles, newParticles, stepParams, start,
+                         end, kernel, pool, visited_out);
+    } else if (use_grid) {
+      simulateStep(cells, particles, newParticles, stepParams, start, end,
+                   kernel, pool, visited_out);
+    } else if (use_dual) {
+      /* in Z-curve order with -morton, like below */
+      simulateStepDual(tree,
+                       dual, use_morton ? tree.leafParticles : particles,
+                       newParticles, stepParams, start, end, kernel, pool,
+                       visited_out);
+    } else if (use_morton) {
+      /* simulate in Z-curve order; the gather below keeps that order */
+      simulateStep(tree, tree.leafParticles, newParticles, stepParams, start,
+                   end, kernel, pool, visited_out);
+    } else {
+      simulateStep(tree, particles, newParticles, stepParams, start, end,
+                   kernel, pool, visited_out);
+    }
+    if (!timesteps.isEnabled())
+      profiler.count(Counter::ForceEvaluations, end - start);
+    profiler.end(Phase::Force);
+
+    /* send newParticles to master */
+    profiler.begin(Phase::Exchange);
+    if (gather_positions) {
+      /* the own slice keeps its full state, the others get positions */
+      std::copy(newParticles.begin(), newParticles.end(),
+                particles.begin() + start);
+      MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, particles.data(),
+                     particle_count.data(), particle_displ.data(),
+                     position_type, MPI_COMM_WORLD);
+    } else {
+      MPI_Allgatherv(
+        newParticles.data(), 
+        newParticles.size() * sizeof(Particle), 
+        MPI_BYTE, 
+        particles.data(), 
+        recv_count.data(),
+        displ.data(),
+        MPI_BYTE,
+        MPI_COMM_WORLD
+      );
+    }
+    profiler.count(Counter::BytesSent,
+                   (double)newParticles.size() *
+                       (gather_positions ? sizeof(Vec2) : sizeof(Particle)) *
+                       (nproc - 1));
+    profiler.end(Phase::Exchange);
   }
 
+  profiler.begin(Phase::Wait);
   MPI_Barrier(MPI_COMM_WORLD);
   double totalSimulationTime = totalSimulationTimer.elapsed();
+  profiler.end(Phase::Wait);
+  if (options.numIterations - first_step > ALLOC_WARMUP_ITERATIONS)
+    profiler.count(Counter::Allocations, heapAllocations() - allocations);
+  for (double v : visited)
+    profiler.count(Counter::NeighborsVisited, v);
 
-  if (pid == COORDINATOR) {
+  /* each rank writes one share of the particles: its own with -dtree,
+     otherwise its slice of the replicated array */
+  if (!options.distributedTree)
+    owned.assign(particles.begin() + start, particles.begin() + end);
+  if (pid == COORDINATOR)
     printf("total simulation time: %.6fs\n", totalSimulationTime);
-    saveToFile(options.outputFile, particles);
-  }
+  if (interval > 0 && options.numIterations > first_step &&
+      options.numIterations % interval == 0)
+    checkpoints.write(owned.data(), owned.size(), num_particles,
+                      options.numIterations);
+  checkpoints.finish();
+  saveParticlesDistributed(options.outputFile, owned, MPI_COMM_WORLD);
+  profiler.report(MPI_COMM_WORLD, options.profileFile);
 
+  MPI_Type_free(&position_type);
   MPI_Finalize();
 }
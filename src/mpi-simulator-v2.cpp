@@ -1,12 +1,36 @@
+#include "alloc-counter.h"
+#include "arena.h"
+#include "checkpoint.h"
 #include "common.h"
+#include "decomposition.h"
+#include "dual-tree.h"
+#include "force-kernel.h"
+#include "gpu-forces.h"
 #include "mpi.h"
+#include "out-of-core.h"
+#include "pair-force.h"
+#include "parallel-io.h"
+#include "profiler.h"
 #include "quad-tree.h"
-#include <unordered_map>
 
 #include "timing.h"
+#include "wire-format.h"
+#include <algorithm>
 #define DEF_TAG 0
+#define COUNT_TAG 1
+#define MIGRATE_TAG 2
 #define COORDINATOR 0
 #define REBUILD_GRANULARITY 2
+#define SIMULATE_CHUNK 64 // particles per thread pool task
+#define OVERLAP_BLOCK 4096 // particles between MPI progress polls
+#define GRID_CELL_SCALE 0.5f // CellGrid cell size relative to cullRadius
+#define LOAD_IMBALANCE_THRESHOLD 1.1 // max / mean rank cost that triggers -lb
+#define ALLOC_WARMUP_ITERATIONS 2 // iterations before allocations are counted
+#define GRAPH_STEPS REBUILD_GRANULARITY // steps a -neighborhood graph serves
+#define MAX_BLOCK_STEPS 8 // -block 0 picks at most this many steps
+#define BLOCK_PROBE_ITERATIONS 2 // steps measured before -block 0 picks
+#define BLOCK_STEP_SLACK 2.0f // per-step displacement bound over max v * dt
+#define OOC_RETILE_INTERVAL 4 // -ooc steps between retilings
 #define cprint if (pid == COORDINATOR) std::cerr
 
 typedef int proc_idx_t;
@@ -14,17 +38,8 @@ typedef int proc_idx_t;
 typedef struct {Vec2 min; Vec2 max;} bound_t;
 
 float radius;
-int dim;
 int nproc;
 proc_idx_t pid;
-float spacedim_x, spacedim_y;
-
-inline proc_idx_t get_pid_of_coord(Vec2 coords, float x_blocksize, float y_blocksize) {
-  int x = (int) coords.x / ceil(x_blocksize);
-  int y = (int) coords.y / ceil(y_blocksize);
-  int retval = y * dim + x;
-  return retval;
-}
 
 inline void update_bounds(Particle p, Vec2 &bmin, Vec2 &bmax) {
   bmin.x = fminf(bmin.x, p.position.x);
@@ -33,141 +48,589 @@ inline void update_bounds(Particle p, Vec2 &bmin, Vec2 &bmax) {
   bmax.y = fmaxf(bmax.y, p.position.y);
 }
 
-inline bool bounds_overlap(bound_t b1, bound_t b2) {
+inline bool bounds_overlap(bound_t b1, bound_t b2, float reach = radius) {
   float dx = fminf(abs(b1.min.x - b2.max.x), abs(b2.min.x - b1.max.x));
   if (b1.max.x >= b2.min.x && b1.min.x <= b2.max.x) dx = 0;
   float dy = fminf(abs(b2.min.y - b1.max.y), abs(b1.min.y - b2.max.y));
   if (b1.max.y >= b2.min.y && b1.min.y <= b2.max.y) dy = 0;
   float dist = (dx * dx) + (dy * dy);
-  return dist <= radius * radius;
+  return dist <= reach * reach;
 }
 
-void simulateStep(QuadTree &tree, const std::vector<Particle> &local_particles,
-                  std::vector<Particle> &newParticles, 
-                  std::vector<Particle> &neighbors, 
-                  StepParameters params, Vec2 &bmin, Vec2 &bmax) {
+// -neighborhood: a distributed graph topology over the ranks whose bounds
+// come within cullRadius + margin of each other, for the exchanges of the
+// GRAPH_STEPS steps after it is built. margin covers two ranks' bounds
+// growing towards each other for that many steps, each step by at most
+// BLOCK_STEP_SLACK times the global max speed times deltaTime, so no rank
+// outside the graph comes within cullRadius before the graph expires and
+// the steps in between need no global collective.
+struct neighbor_graph_t {
+  MPI_Comm comm = MPI_COMM_NULL;
+  std::vector<proc_idx_t> ranks; // in the graph's neighbor order
+  int valid_until = 0;           // first step the graph no longer serves
+};
+
+// neighbor reach for a graph built now, collective for the max speed
+inline float graph_margin(const std::vector<Particle> &particles,
+                          float delta_time) {
+  float max_speed = 0.0f;
+  for (const Particle &p : particles)
+    max_speed = fmaxf(max_speed, p.velocity.length());
+  MPI_Allreduce(MPI_IN_PLACE, &max_speed, 1, MPI_FLOAT, MPI_MAX,
+                MPI_COMM_WORLD);
+  return 2.0f * GRAPH_STEPS * BLOCK_STEP_SLACK * max_speed * delta_time;
+}
+
+// Makes neighbors the graph's ranks from step on. Collective; the topology
+// is only recreated if some rank's neighbors changed.
+void update_graph(neighbor_graph_t &g,
+                  const std::vector<proc_idx_t> &neighbors, int step) {
+  int changed = g.comm == MPI_COMM_NULL || neighbors != g.ranks;
+  MPI_Allreduce(MPI_IN_PLACE, &changed, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+  if (changed) {
+    if (g.comm != MPI_COMM_NULL)
+      MPI_Comm_free(&g.comm);
+    g.ranks = neighbors;
+    // the relation is symmetric, so sources and destinations coincide
+    MPI_Dist_graph_create_adjacent(MPI_COMM_WORLD, g.ranks.size(),
+                                   g.ranks.data(), MPI_UNWEIGHTED,
+                                   g.ranks.size(), g.ranks.data(),
+                                   MPI_UNWEIGHTED, MPI_INFO_NULL, 0, &g.comm);
+  }
+  g.valid_until = step + GRAPH_STEPS;
+}
+
+// One side of a ghost transfer of count particles in the -wire format:
+// the Particles (or their fields) in place.
+struct ghost_msg_t {
+  void *buf;
+  int count;
+  MPI_Datatype type;
+};
+
+inline ghost_msg_t ghost_msg(WireFormat wire, const Particle *particles,
+                             int count, MPI_Datatype ghost_type) {
+  if (wire == WireFormat::Full)
+    return {(void *)particles, count * (int)sizeof(Particle), MPI_BYTE};
+  return {(void *)particles, count, ghost_type};
+}
 
+// node summaries are only needed for Barnes-Hut (theta > 0). With refit the
+// old tree is refit if it still holds the same particles. Returns whether the
+// tree was rebuilt.
+inline bool build_tree(const std::vector<Particle> &particles, QuadTree &tree,
+                       bool morton, bool refit, float theta, ThreadPool &pool) {
+  bool rebuilt = !(refit && tree.refit(particles));
+  if (rebuilt && morton)
+    QuadTree::buildQuadTreeMorton(particles, tree);
+  else if (rebuilt)
+    QuadTree::buildQuadTree(particles, tree, pool);
+  if (theta > 0.0f)
+    tree.summarize();
+  return rebuilt;
+}
+
+// Returns slot_local with slot_local[k] the index in particles of
+// tree.leafParticles[k], for a tree built or refit from particles. Both
+// sides are ordered by id and matched up, so the cost only depends on the
+// local particle count.
+inline const int *map_leaf_slots(const QuadTree &tree,
+                                 const std::vector<Particle> &particles,
+                                 Arena &arena) {
+  const size_t n = particles.size();
+  assert(tree.leafParticles.size() == n);
+  int *by_id = arena.allocate<int>(n);
+  int *slots_by_id = arena.allocate<int>(n);
+  int *slot_local = arena.allocate<int>(n);
+  for (size_t k = 0; k < n; k++)
+    by_id[k] = slots_by_id[k] = (int)k;
+  std::sort(by_id, by_id + n,
+            [&](int a, int b) { return particles[a].id < particles[b].id; });
+  const Particle *slots = tree.leafParticles.data();
+  std::sort(slots_by_id, slots_by_id + n,
+            [&](int a, int b) { return slots[a].id < slots[b].id; });
+  for (size_t k = 0; k < n; k++)
+    slot_local[slots_by_id[k]] = by_id[k];
+  return slot_local;
+}
+
+// Adds to forces[j] the force on particles[j] from every particle of index (a
+// QuadTree or CellGrid), for j = subset[k] (or j = k without a subset) with k
+// in [begin, end). costs[j] counts the attractors evaluated, the work
+// estimate used by the -lb partitioner.
+template <typename Index>
+void accumulate_forces(const Index &index,
+                       const std::vector<Particle> &particles,
+                       const int *subset, size_t begin, size_t end,
+                       Vec2 *forces, std::vector<float> &costs,
+                       StepParameters params, ForceKernelFn kernel,
+                       ThreadPool &pool) {
+  pool.parallelFor(begin, end, SIMULATE_CHUNK, [&](size_t b, size_t e, int) {
+    for (size_t k = b; k < e; k++) {
+      size_t j = subset ? subset[k] : k;
+      int visited = 0;
+      /* Accumulate force from nearby particles straight from the tree */
+      forces[j] +=
+          accumulateForce(index, particles[j], params, kernel, &visited);
+      costs[j] += (float)visited;
+    }
+  });
+}
+
+void simulateStep(const std::vector<Particle> &local_particles,
+                  const Vec2 *forces, std::vector<Particle> &newParticles,
+                  StepParameters params, Vec2 &bmin, Vec2 &bmax) {
+  reserveWithSlack(newParticles, local_particles.size());
   newParticles.resize(local_particles.size());
   /* update each local particle */
   for (size_t j = 0; j < local_particles.size(); j++) {
-      auto p = local_particles[j];
-      Vec2 force = Vec2(0.0f, 0.0f);
-      tree.getParticles(neighbors, p.position, params.cullRadius);
-      /* Iterate through nearby particles and accumulate new force */
-      for (size_t i = 0; i < neighbors.size(); i++) {
-        Particle p1 = neighbors[i];
-        force += computeForce(p, p1, params.cullRadius);
-      }
-      /* Update force */
-      Particle new_p = updateParticle(p, force, params.deltaTime);
-      newParticles[j] = new_p;
-      update_bounds(new_p, bmin, bmax);
+    Particle new_p = updateParticle(local_particles[j], forces[j],
+                                    params.deltaTime);
+    newParticles[j] = new_p;
+    update_bounds(new_p, bmin, bmax);
+  }
+}
+
+inline proc_idx_t owner_of(const Particle &p, const GridDecomposition &grid,
+                           const OrbDecomposition *orb) {
+  return orb ? orb->ownerOf(p.position) : grid.ownerOf(p.position);
+}
+
+// buffers for migrate_particles, kept across redistributions
+struct migration_t {
+  std::vector<int> send_counts, recv_counts, send_displ, owner;
+  std::vector<Particle> send_buf;
+  std::vector<MPI_Request> reqs;
+};
+
+// Sends every local particle that now belongs to another rank straight to
+// its owner and appends the particles arriving from other ranks, so only
+// particles that crossed a region boundary move. kept is scratch space.
+// Returns the number of particles sent.
+int migrate_particles(std::vector<Particle> &local_particles,
+                       std::vector<Particle> &kept,
+                       const GridDecomposition &grid,
+                       const OrbDecomposition *orb, migration_t &m) {
+  m.send_counts.assign(nproc, 0);
+  m.recv_counts.resize(nproc);
+  m.send_displ.resize(nproc);
+  reserveWithSlack(m.owner, local_particles.size());
+  m.owner.resize(local_particles.size());
+  for (size_t j = 0; j < local_particles.size(); j++) {
+    m.owner[j] = owner_of(local_particles[j], grid, orb);
+    if (m.owner[j] != pid)
+      m.send_counts[m.owner[j]]++;
+  }
+  int num_send = 0;
+  for (int r = 0; r < nproc; r++) {
+    m.send_displ[r] = num_send;
+    num_send += m.send_counts[r];
+  }
+
+  reserveWithSlack(m.send_buf, num_send);
+  m.send_buf.resize(num_send);
+  reserveWithSlack(kept, local_particles.size());
+  kept.clear();
+  for (size_t j = 0; j < local_particles.size(); j++) {
+    if (m.owner[j] == pid)
+      kept.push_back(local_particles[j]);
+    else
+      m.send_buf[m.send_displ[m.owner[j]]++] = local_particles[j];
+  }
+
+  MPI_Alltoall(m.send_counts.data(), 1, MPI_INT, m.recv_counts.data(), 1,
+               MPI_INT, MPI_COMM_WORLD);
+
+  // receive directly behind the kept particles
+  size_t offset = kept.size();
+  int num_recv = 0;
+  for (int r = 0; r < nproc; r++)
+    num_recv += m.recv_counts[r];
+  reserveWithSlack(kept, offset + num_recv);
+  kept.resize(offset + num_recv);
+  m.reqs.clear();
+  for (int r = 0; r < nproc; r++) {
+    if (m.recv_counts[r] == 0)
+      continue;
+    m.reqs.emplace_back();
+    MPI_Irecv(kept.data() + offset, m.recv_counts[r] * sizeof(Particle),
+              MPI_BYTE, r, MIGRATE_TAG, MPI_COMM_WORLD, &m.reqs.back());
+    offset += m.recv_counts[r];
+  }
+  for (int r = 0; r < nproc; r++) {
+    if (m.send_counts[r] == 0)
+      continue;
+    int begin = m.send_displ[r] - m.send_counts[r];
+    m.reqs.emplace_back();
+    MPI_Isend(m.send_buf.data() + begin, m.send_counts[r] * sizeof(Particle),
+              MPI_BYTE, r, MIGRATE_TAG, MPI_COMM_WORLD, &m.reqs.back());
+  }
+  MPI_Waitall(m.reqs.size(), m.reqs.data(), MPI_STATUSES_IGNORE);
+  local_particles.swap(kept);
+  return num_send;
+}
+
+// -block: k steps from one exchange. The ghosts are advanced along with
+// the local particles, so their states are recomputed redundantly instead of
+// exchanged, and the halo is wide enough that every ghost that can influence
+// a local particle within the k steps arrives, as long as no particle moves
+// more than max_step per step. A block in which some local particle did is
+// redone one step at a time.
+struct time_block_t {
+  int begin = 0, left = 0;
+  int redo_end = 0; // steps before this are not blocked, they are redone
+  float max_step = 0.0f;
+  bool moved_too_far = false;
+  size_t num_local = 0;
+  std::vector<Particle> start; // local particles at begin
+  bound_t start_bounds;
+  std::vector<Particle> particles; // local particles, then the ghosts
+};
+
+// A particle that influences another within the next k steps starts within
+// k * (cullRadius + 2 (k - 1) max_step) of it: every step covers one
+// cullRadius plus the distance both may have moved since the block began.
+inline float block_halo_width(int k, float cull_radius, float max_step) {
+  return k * (cull_radius + 2.0f * (k - 1) * max_step);
+}
+
+// Picks the steps per exchange with the least modeled time per step: the
+// exchange time comm is paid once per block, while the force work compute
+// grows with the halo, by ghost_ratio (ghosts per local particle at the
+// normal halo width) per cullRadius of width.
+int choose_block_steps(double comm, double compute, double ghost_ratio,
+                       float cull_radius, float max_step) {
+  int best = 1;
+  double best_time = comm + compute;
+  for (int k = 2; k <= MAX_BLOCK_STEPS; k++) {
+    double width = block_halo_width(k, cull_radius, max_step) / cull_radius;
+    double time = comm / k + compute * (1.0 + ghost_ratio * (width - 1.0));
+    if (time < best_time) {
+      best = k;
+      best_time = time;
     }
+  }
+  return best;
 }
 
-void recompute_local_particles(const std::vector<Particle> &particles,
-                               std::vector<Particle> &new_particles, 
-                               Vec2 global_max, Vec2 global_min) {
-  spacedim_x = global_max.x - global_min.x;
-  spacedim_y = global_max.y - global_min.y;
-  float x_blocksize = (spacedim_x / dim);
-  float y_blocksize = (spacedim_y / dim);
-  for (auto p : particles) {
-    Vec2 coord(p.position.x - global_min.x, p.position.y - global_min.y);
-    proc_idx_t place = get_pid_of_coord(coord, x_blocksize, y_blocksize);
-    if (place == pid)
-      new_particles.push_back(p);
+// Sends every rank within width the local particles within width of its
+// bounds and receives theirs into ghosts, as whole Particles, which a block
+// needs to advance the ghosts. Returns the number of particles sent.
+int exchange_block_halo(const std::vector<Particle> &local_particles,
+                        bound_t local_bounds, std::vector<bound_t> &all_bounds,
+                        float width, std::vector<proc_idx_t> &neighbor_procs,
+                        std::vector<std::vector<Particle>> &halo_send,
+                        std::vector<int> &send_counts,
+                        std::vector<int> &recv_counts,
+                        std::vector<Particle> &ghosts, Arena &arena) {
+  MPI_Allgather(&local_bounds, sizeof(bound_t), MPI_BYTE, all_bounds.data(),
+                sizeof(bound_t), MPI_BYTE, MPI_COMM_WORLD);
+  neighbor_procs.clear();
+  for (int j = 0; j < nproc; j++)
+    if (j != pid && bounds_overlap(all_bounds[j], local_bounds, width))
+      neighbor_procs.push_back(j);
+  const int n = neighbor_procs.size();
+  send_counts.resize(n);
+  recv_counts.resize(n);
+  int num_sent = 0;
+  for (int j = 0; j < n; j++) {
+    std::vector<Particle> &send = halo_send[neighbor_procs[j]];
+    const bound_t &nb = all_bounds[neighbor_procs[j]];
+    send.clear();
+    for (const Particle &p : local_particles)
+      if (boxPointDistance(nb.min, nb.max, p.position) <= width)
+        send.push_back(p);
+    send_counts[j] = send.size();
+    num_sent += send.size();
+  }
+  MPI_Request *reqs = arena.allocate<MPI_Request>(2 * n);
+  for (int j = 0; j < n; j++) {
+    MPI_Irecv(&recv_counts[j], 1, MPI_INT, neighbor_procs[j], COUNT_TAG,
+              MPI_COMM_WORLD, &reqs[j]);
+    MPI_Isend(&send_counts[j], 1, MPI_INT, neighbor_procs[j], COUNT_TAG,
+              MPI_COMM_WORLD, &reqs[n + j]);
+  }
+  MPI_Waitall(2 * n, reqs, MPI_STATUSES_IGNORE);
+  int num_ghosts = 0;
+  for (int j = 0; j < n; j++)
+    num_ghosts += recv_counts[j];
+  reserveWithSlack(ghosts, num_ghosts);
+  ghosts.resize(num_ghosts);
+  int offset = 0;
+  for (int j = 0; j < n; j++) {
+    MPI_Irecv(ghosts.data() + offset, recv_counts[j] * sizeof(Particle),
+              MPI_BYTE, neighbor_procs[j], DEF_TAG, MPI_COMM_WORLD, &reqs[j]);
+    offset += recv_counts[j];
+    MPI_Isend(halo_send[neighbor_procs[j]].data(),
+              send_counts[j] * sizeof(Particle), MPI_BYTE, neighbor_procs[j],
+              DEF_TAG, MPI_COMM_WORLD, &reqs[n + j]);
   }
+  MPI_Waitall(2 * n, reqs, MPI_STATUSES_IGNORE);
+  return num_sent;
+}
+
+// -ooc: the whole run streamed through region files, see out-of-core.h.
+// Steps the loaded particles (a checkpoint with -restart) like the
+// in-memory loop; snapshots are not written.
+void run_out_of_core(const StartupOptions &options) {
+  StepParameters stepParams = getBenchmarkStepParams(options.spaceSize);
+  stepParams.theta = options.theta;
+  ForceKernelFn kernel =
+      selectForceKernel(parseForceKernelISA(options.forceKernel));
+  ThreadPool pool(options.numThreads);
+  PhaseProfiler profiler(options.profile, options.numIterations);
+  OutOfCoreSimulation sim(options.outOfCoreDir, options.tileParticles,
+                          stepParams, kernel, pool, profiler, MPI_COMM_WORLD);
+  sim.load(options.inputFile);
+  if (options.checkpointInterval > 0)
+    cprint << "-checkpoint is not supported with -ooc" << std::endl;
+  Timer totalSimulationTimer;
+
+  for (int i = options.restartStep; i < options.numIterations; i++) {
+    profiler.nextIteration();
+    if (i > options.restartStep && i % OOC_RETILE_INTERVAL == 0)
+      sim.retile();
+    sim.step();
+  }
+
+  profiler.begin(Phase::Wait);
+  MPI_Barrier(MPI_COMM_WORLD);
+  double totalSimulationTime = totalSimulationTimer.elapsed();
+  profiler.end(Phase::Wait);
+  if (pid == COORDINATOR)
+    printf("total simulation time: %.6fs\n", totalSimulationTime);
+  sim.save(options.outputFile);
+  profiler.report(MPI_COMM_WORLD, options.profileFile);
 }
 
 int main(int argc, char *argv[]) {
 
-  // Initialize MPI
-  MPI_Init(&argc, &argv);
+  // Initialize MPI, only the main thread of each rank communicates
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   // Get process rank
   MPI_Comm_rank(MPI_COMM_WORLD, &pid);
   // Get total number of processes specificed at start of run
   MPI_Comm_size(MPI_COMM_WORLD, &nproc);
 
   StartupOptions options = parseOptions(argc, argv);
+  if (!options.outOfCoreDir.empty()) {
+    run_out_of_core(options);
+    MPI_Finalize();
+    return 0;
+  }
 
   std::vector<proc_idx_t> neighbor_procs;
-  std::vector<Particle> particles, new_particles, local_particles, neighbors;
-  loadFromFile(options.inputFile, particles);
+  // ghost zone exchange: send buffers by rank, so each keeps the capacity
+  // for its neighbor; counts one slot per neighbor
+  std::vector<std::vector<Particle>> halo_send;
+  std::vector<int> halo_send_counts, halo_recv_counts;
+  // -pairs: local-local pairs evaluated once, ghosts still one-sided;
+  // -dual: local forces leaf against leaf
+  PairForceAccumulator pair_forces;
+  DualTreeForces dual_forces;
+  std::vector<Particle> new_particles, local_particles, neighbors;
+  // every rank reads a contiguous share of the file, the first
+  // redistribution below sends the particles to their owners
+  loadParticlesDistributed(options.inputFile, local_particles, MPI_COMM_WORLD);
   Vec2 bmin(1e30f, 1e30f);
   Vec2 bmax(-1e30f, -1e30f);
-  dim = sqrt(nproc);
+  for (auto p : local_particles) {
+    update_bounds(p, bmin, bmax);
+  }
 
   StepParameters stepParams = getBenchmarkStepParams(options.spaceSize);
+  stepParams.theta = options.theta;
   radius = stepParams.cullRadius;
+  ForceKernelFn kernel =
+      selectForceKernel(parseForceKernelISA(options.forceKernel));
+  PairForceKernelFn pair_kernel =
+      selectPairForceKernel(parseForceKernelISA(options.forceKernel));
   // Don't change the timeing for totalSimulationTime.
 
-  std::unordered_map<int, int> ord;
-  int i = 0;
-  for (auto p : particles) {
-    std::pair<int, int> elem (p.id, i);
-    ord.insert(elem);
-    i += 1;
-  }
-  
-  int num_local_particles;
-  int particle_list_sizes[nproc];
-  int particle_list_displ[nproc];
+  migration_t migration;
   bound_t local_bounds;
-  bound_t all_bounds[nproc];
+  std::vector<bound_t> all_bounds(nproc);
+  // ghosts travel in the -wire format, migrations as whole Particles
+  const WireFormat wire = parseWireFormat(options.wireFormat);
+  MPI_Datatype ghost_type = createParticleFieldsType(true);
+  // -neighborhood: bounds and ghosts between redistributions go over a
+  // graph topology instead of MPI_COMM_WORLD
+  const bool use_graph = options.neighborCollectives;
+  neighbor_graph_t graph;
+  graph.ranks.reserve(nproc);
+  neighbor_procs.reserve(nproc);
+  halo_send.resize(nproc);
+  // local particles and received ghosts, buffers are reused across
+  // iterations
+  QuadTree tree, ghost_tree;
+  CellGrid cells, ghost_cells;
+  const float cell_size = stepParams.cullRadius * GRID_CELL_SCALE;
+  bool use_grid;
+  long long num_particles;
+  {
+    float lo[2] = {bmin.x, bmin.y}, hi[2] = {bmax.x, bmax.y};
+    long long count = local_particles.size();
+    MPI_Allreduce(MPI_IN_PLACE, lo, 2, MPI_FLOAT, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, hi, 2, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(&count, &num_particles, 1, MPI_LONG_LONG, MPI_SUM,
+                  MPI_COMM_WORLD);
+    use_grid = useCellGrid(options.spatialIndex, Vec2(lo[0], lo[1]),
+                           Vec2(hi[0], hi[1]), num_particles,
+                           stepParams.cullRadius);
+  }
+  // pair evaluation needs exact forces from the local tree
+  const bool use_pairs =
+      options.pairForces && !use_grid && stepParams.theta == 0.0f;
+  const bool use_dual = options.dualTree && !use_pairs && !use_grid &&
+                        stepParams.theta == 0.0f;
+  // -gpu: forces and integration of the regular steps on this rank's GPU,
+  // from the host-built trees, if the build has the backend and the node a
+  // device
+  const bool want_gpu = options.gpu && !use_grid && !use_pairs && !use_dual;
+  GpuStepper gpu;
+  bool use_gpu = false;
+  if (want_gpu) {
+    MPI_Comm node_comm;
+    int local_rank;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, pid,
+                        MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &local_rank);
+    MPI_Comm_free(&node_comm);
+    use_gpu = gpu.init(local_rank);
+  }
+  if (options.gpu && !use_gpu)
+    cprint << "-gpu unavailable, using the host\n";
+  MortonSorter morton;
+  std::vector<float> costs; // per local particle, from the last step
+  GridDecomposition grid;
+  OrbDecomposition orb;
+  bool balanced = false; // orb holds cost-weighted cuts from -lb
+  ThreadPool pool(options.numThreads);
+  // scratch that lives for one iteration: ghost exchange requests, boundary
+  // indices, forces and the -pairs / -dual id map
+  Arena arena;
+  // -block 0 picks the block size from the profiler's phase times
+  PhaseProfiler profiler(options.profile, options.numIterations,
+                         options.blockSteps == 0);
+  int block_steps = std::max(options.blockSteps, 1);
+  long long probe_ghosts = 0, probe_local = 0;
+  time_block_t block;
+  // -restart: the loaded snapshot is the state after first_step steps
+  const int first_step = options.restartStep;
+  int last_redistribution = first_step - REBUILD_GRANULARITY;
+  // -checkpoint: snapshots of the local particles between steps; blocks
+  // end at snapshot steps
+  CheckpointWriter checkpoints(options.checkpointFile, MPI_COMM_WORLD);
+  const int interval = options.checkpointInterval;
+  int last_checkpoint = first_step;
   Timer totalSimulationTimer;
 
-  for (int i = 0; i < options.numIterations; i++) {
-    if (i % REBUILD_GRANULARITY == 0) {
+  long long allocations = 0;
+  for (int i = first_step; i < options.numIterations; i++) {
+    // the steps of a failed block are run again; they are counted apart and
+    // timed into the record of the block's last step, so there is one record
+    // per step
+    const bool redone = i < block.redo_end;
+    if (redone)
+      profiler.count(Counter::RedoneSteps, 1);
+    else
+      profiler.nextIteration();
+    /* the buffers have reached their steady-state sizes by now */
+    if (!redone && i - first_step == ALLOC_WARMUP_ITERATIONS)
+      allocations = heapAllocations();
+    arena.reset();
+    if (interval > 0 && i % interval == 0 && i > last_checkpoint &&
+        block.left == 0) {
+      checkpoints.write(local_particles.data(), local_particles.size(),
+                        num_particles, i);
+      last_checkpoint = i;
+    }
+    const int step = i - first_step; // steps run so far
+    if (options.blockSteps == 0 && step == 1 + BLOCK_PROBE_ITERATIONS &&
+        !redone) {
+      // exchange against compute time of the slowest rank, and the halo
+      // sizes and particle speeds over all ranks
+      double times[2] = {0.0, 0.0};
+      for (Phase p : {Phase::Exchange, Phase::Wait})
+        times[0] += profiler.seconds(p, 1, step);
+      for (Phase p : {Phase::Build, Phase::Force, Phase::Integrate})
+        times[1] += profiler.seconds(p, 1, step);
+      long long sizes[2] = {probe_ghosts, probe_local};
+      float max_speed = 0.0f;
+      for (const Particle &p : local_particles)
+        max_speed = fmaxf(max_speed, p.velocity.length());
+      MPI_Allreduce(MPI_IN_PLACE, times, 2, MPI_DOUBLE, MPI_MAX,
+                    MPI_COMM_WORLD);
+      MPI_Allreduce(MPI_IN_PLACE, sizes, 2, MPI_LONG_LONG, MPI_SUM,
+                    MPI_COMM_WORLD);
+      MPI_Allreduce(MPI_IN_PLACE, &max_speed, 1, MPI_FLOAT, MPI_MAX,
+                    MPI_COMM_WORLD);
+      block_steps = choose_block_steps(
+          times[0], times[1], sizes[1] > 0 ? (double)sizes[0] / sizes[1] : 0.0,
+          radius, BLOCK_STEP_SLACK * max_speed * stepParams.deltaTime);
+      cprint << "time blocking: " << block_steps << " steps per exchange\n";
+    }
+    // a block of at least two steps starts here, unless this step is redone
+    const bool block_start = block.left == 0 && block_steps > 1 &&
+                             !redone && i + 1 < options.numIterations;
+    const bool redistribute =
+        block.left == 0 && i - last_redistribution >= REBUILD_GRANULARITY;
+    if (redistribute) {
+      PhaseProfiler::Scope scope(profiler, Phase::Redistribute);
+      last_redistribution = i;
       local_bounds = {bmin, bmax};
       MPI_Allgather(&local_bounds, sizeof(bound_t), MPI_BYTE, 
-        all_bounds, sizeof(bound_t), MPI_BYTE, MPI_COMM_WORLD);
+        all_bounds.data(), sizeof(bound_t), MPI_BYTE, MPI_COMM_WORLD);
 
       Vec2 global_min(1e30f, 1e30f);
       Vec2 global_max(-1e30f, -1e30f);
 
-      if (i != 0) {
-        // combine new particles into particles.data() 
-        // by allgathering local particle list
-        MPI_Allgatherv(
-          local_particles.data(), 
-          num_local_particles * sizeof(Particle),
-          MPI_BYTE,
-          particles.data(),
-          particle_list_sizes,
-          particle_list_displ,
-          MPI_BYTE,
-          MPI_COMM_WORLD);
-
-        // update global bounds based on collective bound data
-        for (auto bound : all_bounds) {
-          global_min.x = fminf(global_min.x, bound.min.x);
-          global_min.y = fminf(global_min.y, bound.min.y);
-          global_max.x = fmaxf(global_max.x, bound.max.x);
-          global_max.y = fmaxf(global_max.y, bound.max.y);
-        }
-      } else { // initialize global bounds
-        for (auto p : particles) {
-          update_bounds(p, global_min, global_max);
+      // update global bounds based on collective bound data
+      for (auto bound : all_bounds) {
+        global_min.x = fminf(global_min.x, bound.min.x);
+        global_min.y = fminf(global_min.y, bound.min.y);
+        global_max.x = fmaxf(global_max.x, bound.max.x);
+        global_max.y = fmaxf(global_max.y, bound.max.y);
+      }
+
+      // with -lb, re-cut the domain by the measured cost of the last step
+      // once the ranks drift too far apart
+      if (i != 0 && options.loadBalance) {
+        double local_cost = 0.0, max_cost, total_cost;
+        for (float c : costs)
+          local_cost += c;
+        MPI_Allreduce(&local_cost, &max_cost, 1, MPI_DOUBLE, MPI_MAX,
+                      MPI_COMM_WORLD);
+        MPI_Allreduce(&local_cost, &total_cost, 1, MPI_DOUBLE, MPI_SUM,
+                      MPI_COMM_WORLD);
+        if (total_cost > 0.0 &&
+            max_cost * nproc / total_cost > LOAD_IMBALANCE_THRESHOLD) {
+          orb.build(local_particles, costs.data(), global_min, global_max,
+                    nproc, MPI_COMM_WORLD);
+          balanced = true;
         }
       }
       
-      // recompute which particles belong to this process
-      local_particles.clear();
-      recompute_local_particles(particles, local_particles, global_max, global_min);
+      // without cost-weighted cuts, use the most square grid for nproc, or
+      // count-balanced cuts if the grid cells would be too elongated
+      bool use_orb = balanced;
+      if (!balanced && !grid.set(global_min, global_max, nproc)) {
+        orb.build(local_particles, nullptr, global_min, global_max, nproc,
+                  MPI_COMM_WORLD);
+        use_orb = true;
+      }
 
-      // communicate size of each particle list
-      num_local_particles = local_particles.size();
-      MPI_Allgather(&num_local_particles, 1, MPI_INT,
-        particle_list_sizes, 1, MPI_INT, MPI_COMM_WORLD);
+      // hand particles that left our region (or, on the first iteration,
+      // that were read by another rank) to their new owners
+      int migrated = migrate_particles(local_particles, new_particles, grid,
+                                       use_orb ? &orb : nullptr, migration);
+      profiler.count(Counter::ParticlesMigrated, migrated);
+      profiler.count(Counter::BytesSent, (double)migrated * sizeof(Particle));
 
-      // Calculate displacements
-      unsigned int acc = 0;
-      for (int j = 0; j < nproc; j++) {
-        particle_list_sizes[j] *= sizeof(Particle);
-        particle_list_displ[j] = acc;
-        acc += particle_list_sizes[j];
-      }
+      // keep local particles in Z-curve order until the next redistribution
+      if (options.mortonOrder)
+        sortByMorton(local_particles, morton, new_particles);
 
       // compute bounds
       bmin = Vec2(1e30f, 1e30f);
@@ -177,111 +640,395 @@ int main(int argc, char *argv[]) {
       }
 
     } // end periodic particle redistribution
+
+    if (block_start) {
+      profiler.begin(Phase::Exchange);
+      block.begin = i;
+      block.left = std::min(block_steps, options.numIterations - i);
+      if (interval > 0)
+        block.left = std::min(block.left, interval - i % interval);
+      float max_speed = 0.0f;
+      for (const Particle &p : local_particles)
+        max_speed = fmaxf(max_speed, p.velocity.length());
+      MPI_Allreduce(MPI_IN_PLACE, &max_speed, 1, MPI_FLOAT, MPI_MAX,
+                    MPI_COMM_WORLD);
+      block.max_step = BLOCK_STEP_SLACK * max_speed * stepParams.deltaTime;
+      block.moved_too_far = false;
+      block.num_local = local_particles.size();
+      block.start_bounds = {bmin, bmax};
+      reserveWithSlack(block.start, local_particles.size());
+      block.start.assign(local_particles.begin(), local_particles.end());
+      const float width =
+          block_halo_width(block.left, radius, block.max_step);
+      int sent = exchange_block_halo(local_particles, block.start_bounds,
+                                     all_bounds, width, neighbor_procs,
+                                     halo_send, halo_send_counts,
+                                     halo_recv_counts, neighbors, arena);
+      profiler.count(Counter::BytesSent, (double)sent * sizeof(Particle));
+      std::vector<Particle> &all = block.particles;
+      reserveWithSlack(all, local_particles.size() + neighbors.size());
+      all.assign(local_particles.begin(), local_particles.end());
+      all.insert(all.end(), neighbors.begin(), neighbors.end());
+      profiler.end(Phase::Exchange);
+    }
+    if (block.left > 0) {
+      // forces on and updates of the local particles and ghosts alike
+      std::vector<Particle> &all = block.particles;
+      profiler.begin(Phase::Build);
+      if (use_grid) {
+        CellGrid::build(all, cells, cell_size);
+      } else {
+        bool rebuilt = build_tree(all, tree, options.mortonOrder, false,
+                                  stepParams.theta, pool);
+        if (rebuilt)
+          profiler.count(Counter::TreeRebuilds, 1);
+      }
+      profiler.end(Phase::Build);
+      profiler.begin(Phase::Force);
+      Vec2 *forces = arena.allocate<Vec2>(all.size());
+      std::fill(forces, forces + all.size(), Vec2(0.0f, 0.0f));
+      reserveWithSlack(costs, all.size());
+      costs.assign(all.size(), 0.0f);
+      if (use_grid)
+        accumulate_forces(cells, all, nullptr, 0, all.size(), forces, costs,
+                          stepParams, kernel, pool);
+      else
+        accumulate_forces(tree, all, nullptr, 0, all.size(), forces, costs,
+                          stepParams, kernel, pool);
+      profiler.count(Counter::ForceEvaluations, all.size());
+      profiler.end(Phase::Force);
+      profiler.begin(Phase::Integrate);
+      Vec2 lo(1e30f, 1e30f), hi(-1e30f, -1e30f);
+      new_particles.clear();
+      simulateStep(all, forces, new_particles, stepParams, lo, hi);
+      all.swap(new_particles);
+      // the positions the remaining steps start from must have kept to
+      // the halo's displacement bound
+      const float reach = (i + 1 - block.begin) * block.max_step;
+      for (size_t j = 0; j < block.num_local && block.left > 1; j++)
+        if ((all[j].position - block.start[j].position).length() > reach)
+          block.moved_too_far = true;
+      profiler.end(Phase::Integrate);
+      if (--block.left > 0)
+        continue;
+
+      profiler.begin(Phase::Wait);
+      int redo = block.moved_too_far;
+      MPI_Allreduce(MPI_IN_PLACE, &redo, 1, MPI_INT, MPI_LOR, MPI_COMM_WORLD);
+      profiler.end(Phase::Wait);
+      costs.resize(block.num_local);
+      if (redo) {
+        local_particles.swap(block.start);
+        bmin = block.start_bounds.min;
+        bmax = block.start_bounds.max;
+        block.redo_end = i + 1;
+        i = block.begin - 1;
+        continue;
+      }
+      local_particles.assign(all.begin(), all.begin() + block.num_local);
+      bmin = Vec2(1e30f, 1e30f);
+      bmax = Vec2(-1e30f, -1e30f);
+      for (const Particle &p : local_particles)
+        update_bounds(p, bmin, bmax);
+      continue;
+    }
+    profiler.begin(Phase::Exchange);
     // processes communicate boundaries (allgather)
     local_bounds.min = bmin;
     local_bounds.max = bmax;
-    MPI_Allgather(&local_bounds, sizeof(bound_t), MPI_BYTE, 
-      all_bounds, sizeof(bound_t), MPI_BYTE, MPI_COMM_WORLD);
-    
-    // determine set of neighbors
-    neighbor_procs.clear();
-    for (int j = 0; j < nproc; j++) {
-      if (j != pid && bounds_overlap(all_bounds[j], local_bounds)) {
-        neighbor_procs.push_back(j);
+    // with the graph, only after a redistribution or once the graph has
+    // expired (or was never built: -block steps bypass it), which every
+    // rank decides alike
+    const bool gather_bounds = !use_graph || redistribute ||
+                               graph.comm == MPI_COMM_NULL ||
+                               i >= graph.valid_until;
+    if (gather_bounds) {
+      MPI_Allgather(&local_bounds, sizeof(bound_t), MPI_BYTE, 
+        all_bounds.data(), sizeof(bound_t), MPI_BYTE, MPI_COMM_WORLD);
+      
+      // determine set of neighbors, with the margin for the graph
+      const float reach =
+          use_graph ? radius + graph_margin(local_particles,
+                                            stepParams.deltaTime)
+                    : radius;
+      neighbor_procs.clear();
+      for (int j = 0; j < nproc; j++) {
+        if (j != pid && bounds_overlap(all_bounds[j], local_bounds, reach)) {
+          neighbor_procs.push_back(j);
+        }
       }
+      if (use_graph)
+        update_graph(graph, neighbor_procs, i);
+    } else {
+      // the graph neighbors' bounds, some of which may be out of reach
+      bound_t *graph_bounds = arena.allocate<bound_t>(neighbor_procs.size());
+      MPI_Neighbor_allgather(&local_bounds, sizeof(bound_t), MPI_BYTE,
+                             graph_bounds, sizeof(bound_t), MPI_BYTE,
+                             graph.comm);
+      for (size_t j = 0; j < neighbor_procs.size(); j++)
+        all_bounds[neighbor_procs[j]] = graph_bounds[j];
     }
 
-    // async send local particles
+    // pack the ghost zone for each neighbor: only local particles within
+    // cullRadius of the neighbor's bounds can affect its particles. Particles
+    // sent anywhere are boundary particles, all others are interior.
     int num_neighbor_procs = neighbor_procs.size();
-    MPI_Request send_reqs[num_neighbor_procs];
+    halo_send_counts.resize(num_neighbor_procs);
+    halo_recv_counts.resize(num_neighbor_procs);
+    for (int j = 0; j < num_neighbor_procs; j++)
+      halo_send[neighbor_procs[j]].clear();
+    int *boundary = arena.allocate<int>(local_particles.size());
+    size_t num_boundary = 0;
+    for (size_t k = 0; k < local_particles.size(); k++) {
+      const Particle &p = local_particles[k];
+      bool is_boundary = false;
+      for (int j = 0; j < num_neighbor_procs; j++) {
+        bound_t nb = all_bounds[neighbor_procs[j]];
+        if (boxPointDistance(nb.min, nb.max, p.position) <= radius) {
+          halo_send[neighbor_procs[j]].push_back(p);
+          is_boundary = true;
+        }
+      }
+      if (is_boundary)
+        boundary[num_boundary++] = k;
+    }
     for (int j = 0; j < num_neighbor_procs; j++) {
-      proc_idx_t cur_neighbor = neighbor_procs[j];
-      MPI_Isend(
-        local_particles.data(), 
-        num_local_particles * sizeof(Particle), 
-        MPI_BYTE, 
-        cur_neighbor,
-        DEF_TAG,
-        MPI_COMM_WORLD,
-        &send_reqs[j]);
+      halo_send_counts[j] = halo_send[neighbor_procs[j]].size();
+      profiler.count(Counter::BytesSent,
+                     (double)halo_send_counts[j] * wireBytes(wire));
     }
 
-    // determine offsets to receive data from (prefix sum)
-    int neighbors_displ[num_neighbor_procs];
-    int num_neighbor_particles = 0;
-    for (int j = 0; j < num_neighbor_procs; j++) {
-      neighbors_displ[j] = num_neighbor_particles;
-      num_neighbor_particles += particle_list_sizes[neighbor_procs[j]];
+    // exchange ghost counts while the local tree is built: one request per
+    // transfer, or one neighborhood collective over the graph
+    const int num_halo_reqs = use_graph ? 1 : 2 * num_neighbor_procs;
+    MPI_Request *halo_reqs = arena.allocate<MPI_Request>(num_halo_reqs);
+    int *halo_done = arena.allocate<int>(num_halo_reqs);
+    if (use_graph)
+      MPI_Ineighbor_alltoall(halo_send_counts.data(), 1, MPI_INT,
+                             halo_recv_counts.data(), 1, MPI_INT, graph.comm,
+                             halo_reqs);
+    for (int j = 0; j < num_neighbor_procs && !use_graph; j++) {
+      MPI_Irecv(&halo_recv_counts[j], 1, MPI_INT, neighbor_procs[j],
+                COUNT_TAG, MPI_COMM_WORLD, &halo_reqs[j]);
+      MPI_Isend(&halo_send_counts[j], 1, MPI_INT, neighbor_procs[j],
+                COUNT_TAG, MPI_COMM_WORLD, &halo_reqs[num_neighbor_procs + j]);
+    }
+    profiler.end(Phase::Exchange);
+    profiler.begin(Phase::Build);
+    if (use_grid) {
+      CellGrid::build(local_particles, cells, cell_size);
+    } else {
+      bool rebuilt = build_tree(local_particles, tree, options.mortonOrder,
+                                options.refitTree, stepParams.theta, pool);
+      if (rebuilt)
+        profiler.count(Counter::TreeRebuilds, 1);
     }
-    num_neighbor_particles /= sizeof(Particle);
+    profiler.end(Phase::Build);
+    profiler.begin(Phase::Wait);
+    MPI_Waitall(num_halo_reqs, halo_reqs, MPI_STATUSES_IGNORE);
+    profiler.end(Phase::Wait);
 
-    // receive neighbors' particles (async)
-    neighbors.clear();
+    // post the variable-size ghost transfers
+    profiler.begin(Phase::Exchange);
+    int num_neighbor_particles = 0;
+    for (int j = 0; j < num_neighbor_procs; j++)
+      num_neighbor_particles += halo_recv_counts[j];
+    if (step > 0 && step <= BLOCK_PROBE_ITERATIONS) {
+      probe_ghosts += num_neighbor_particles;
+      probe_local += local_particles.size();
+    }
+    reserveWithSlack(neighbors, num_neighbor_particles);
     neighbors.resize(num_neighbor_particles);
-    void *dest = (void *)neighbors.data();
-    MPI_Request recv_reqs[num_neighbor_procs];
+
+    // receives first, then sends, like the requests
+    ghost_msg_t *msgs = arena.allocate<ghost_msg_t>(2 * num_neighbor_procs);
     int counter = 0;
     for (int j = 0; j < num_neighbor_procs; j++) {
-      proc_idx_t cur_neighbor = neighbor_procs[j];
-      void *dest_buf = (void *)((char *)dest + counter);
-      int recv_bytes = (particle_list_sizes[cur_neighbor]);
-      
-      MPI_Irecv(
-        dest_buf, 
-        recv_bytes,
-        MPI_BYTE,
-        cur_neighbor,
-        DEF_TAG,
-        MPI_COMM_WORLD,
-        &recv_reqs[j]);
-      counter += particle_list_sizes[cur_neighbor];
+      msgs[j] = ghost_msg(wire, neighbors.data() + counter,
+                          halo_recv_counts[j], ghost_type);
+      counter += halo_recv_counts[j];
     }
     for (int j = 0; j < num_neighbor_procs; j++) {
-      // MPI_Status status;
-      // int count;
-      // int recv_bytes = (particle_list_sizes[neighbor_procs[j]]);
-      // MPI_Wait(&recv_reqs[j], &status);
-      // MPI_Get_count(&status, MPI_BYTE, &count);
-      // if (count != recv_bytes) {
-      //   std::cerr << "bad count received: " << count << " vs " << recv_bytes << std::endl;
-      // }
-      MPI_Wait(&recv_reqs[j], MPI_STATUS_IGNORE);
+      const std::vector<Particle> &send = halo_send[neighbor_procs[j]];
+      msgs[num_neighbor_procs + j] =
+          ghost_msg(wire, send.data(), send.size(), ghost_type);
+    }
+    if (use_graph) {
+      // every buffer by its address, so nothing is copied together
+      const int num_msgs = 2 * num_neighbor_procs;
+      int *counts = arena.allocate<int>(num_msgs);
+      MPI_Aint *displs = arena.allocate<MPI_Aint>(num_msgs);
+      MPI_Datatype *types = arena.allocate<MPI_Datatype>(num_msgs);
+      for (int k = 0; k < num_msgs; k++) {
+        counts[k] = msgs[k].count;
+        displs[k] = 0;
+        if (msgs[k].count > 0)
+          MPI_Get_address(msgs[k].buf, &displs[k]);
+        types[k] = msgs[k].type;
+      }
+      const int n = num_neighbor_procs;
+      MPI_Ineighbor_alltoallw(MPI_BOTTOM, counts + n, displs + n, types + n,
+                              MPI_BOTTOM, counts, displs, types, graph.comm,
+                              halo_reqs);
     }
+    for (int j = 0; j < num_neighbor_procs && !use_graph; j++)
+      MPI_Irecv(msgs[j].buf, msgs[j].count, msgs[j].type, neighbor_procs[j],
+                DEF_TAG, MPI_COMM_WORLD, &halo_reqs[j]);
+    for (int j = 0; j < num_neighbor_procs && !use_graph; j++) {
+      const ghost_msg_t &m = msgs[num_neighbor_procs + j];
+      MPI_Isend(m.buf, m.count, m.type, neighbor_procs[j], DEF_TAG,
+                MPI_COMM_WORLD, &halo_reqs[num_neighbor_procs + j]);
+    }
+    profiler.end(Phase::Exchange);
 
-    // add local particles to neighbors
-    for (auto p : local_particles) {
-      neighbors.push_back(p);
+    // while ghosts are in flight, accumulate the local part of every force,
+    // which is the whole force for interior particles; poll between blocks
+    // so the transfers progress
+    profiler.begin(Phase::Force);
+    size_t num_local = local_particles.size();
+    Vec2 *forces = arena.allocate<Vec2>(num_local);
+    std::fill(forces, forces + num_local, Vec2(0.0f, 0.0f));
+    reserveWithSlack(costs, num_local);
+    costs.assign(num_local, 0.0f);
+    if (use_pairs || use_dual) {
+      // both passes go over the local tree's leaves and leave the forces by
+      // tree slot
+      if (use_pairs)
+        pair_forces.begin(tree, pool);
+      else
+        dual_forces.begin(tree, pool);
+      const size_t num_leaves =
+          use_pairs ? pair_forces.numLeaves() : dual_forces.numLeaves();
+      const size_t leaf_block = OVERLAP_BLOCK / QuadTreeLeafSize;
+      for (size_t b = 0; b < num_leaves; b += leaf_block) {
+        const size_t e = std::min(b + leaf_block, num_leaves);
+        if (use_pairs)
+          pair_forces.accumulate(tree, b, e, stepParams.cullRadius,
+                                 pair_kernel, pool);
+        else
+          dual_forces.accumulate(tree, tree, b, e, stepParams.cullRadius,
+                                 kernel, pool);
+        int num_done;
+        MPI_Testsome(num_halo_reqs, halo_reqs, &num_done,
+                     halo_done, MPI_STATUSES_IGNORE);
+      }
+      const int *slot_local = map_leaf_slots(tree, local_particles, arena);
+      auto add = [&](int slot, Vec2 force, float cost) {
+        int j = slot_local[slot];
+        forces[j] += force;
+        costs[j] += cost;
+      };
+      if (use_pairs)
+        pair_forces.finish(tree, add);
+      else
+        dual_forces.finish(tree, add);
+    }
+    // runs while the ghosts are in flight; a device out of memory turns
+    // -gpu off for the rest of the run
+    if (use_gpu &&
+        !gpu.beginLocal(gpuTreeView(tree, stepParams.theta > 0.0f),
+                        gpuParticles(local_particles.data()), num_local,
+                        stepParams.cullRadius, stepParams.theta)) {
+      use_gpu = false;
+      std::cerr << "rank " << pid << ": -gpu failed, using the host\n";
+    }
+    for (size_t b = 0; b < num_local && !use_pairs && !use_dual && !use_gpu;
+         b += OVERLAP_BLOCK) {
+      size_t e = std::min(b + OVERLAP_BLOCK, num_local);
+      if (use_grid)
+        accumulate_forces(cells, local_particles, nullptr, b, e, forces,
+                          costs, stepParams, kernel, pool);
+      else
+        accumulate_forces(tree, local_particles, nullptr, b, e, forces, costs,
+                          stepParams, kernel, pool);
+      int num_done;
+      MPI_Testsome(num_halo_reqs, halo_reqs, &num_done,
+                   halo_done, MPI_STATUSES_IGNORE);
+    }
+    profiler.end(Phase::Force);
+    profiler.begin(Phase::Wait);
+    MPI_Waitall(num_halo_reqs, halo_reqs, MPI_STATUSES_IGNORE);
+    profiler.end(Phase::Wait);
+
+    // boundary particles add the ghosts' contribution
+    const bool with_ghosts = !neighbors.empty() && num_boundary > 0;
+    if (with_ghosts) {
+      profiler.begin(Phase::Build);
+      if (use_grid)
+        CellGrid::build(neighbors, ghost_cells, cell_size);
+      else
+        // the halo changes every step, so it is always rebuilt
+        build_tree(neighbors, ghost_tree, options.mortonOrder, false,
+                   stepParams.theta, pool);
+      profiler.end(Phase::Build);
+    }
+    // the device integrates too; if it fails, the step runs on the host
+    bool gpu_done = false;
+    if (use_gpu) {
+      profiler.begin(Phase::Force);
+      reserveWithSlack(new_particles, num_local);
+      new_particles.resize(num_local);
+      GpuTree ghosts;
+      if (with_ghosts)
+        ghosts = gpuTreeView(ghost_tree, stepParams.theta > 0.0f);
+      gpu_done = gpu.finish(ghosts, stepParams.deltaTime,
+                            gpuParticles(new_particles.data()), costs.data());
+      if (!gpu_done)
+        accumulate_forces(tree, local_particles, nullptr, 0, num_local,
+                          forces, costs, stepParams, kernel, pool);
+      profiler.end(Phase::Force);
     }
+    if (with_ghosts && !gpu_done) {
+      profiler.begin(Phase::Force);
+      if (use_grid)
+        accumulate_forces(ghost_cells, local_particles, boundary, 0,
+                          num_boundary, forces, costs, stepParams, kernel,
+                          pool);
+      else
+        accumulate_forces(ghost_tree, local_particles, boundary, 0,
+                          num_boundary, forces, costs, stepParams, kernel,
+                          pool);
+      profiler.end(Phase::Force);
+    }
+    profiler.count(Counter::ForceEvaluations, num_local);
+    if (profiler.isEnabled())
+      for (float c : costs)
+        profiler.count(Counter::NeighborsVisited, c);
+
     // run simulation iteration
-    QuadTree tree;
-    QuadTree::buildQuadTree(neighbors, tree); // TODO: MODIFIED
-    new_particles.clear();
-    simulateStep(tree, local_particles, new_particles, neighbors, stepParams, bmin, bmax);
+    profiler.begin(Phase::Integrate);
+    if (gpu_done) {
+      for (const Particle &p : new_particles)
+        update_bounds(p, bmin, bmax);
+    } else {
+      new_particles.clear();
+      simulateStep(local_particles, forces, new_particles, stepParams, bmin,
+                   bmax);
+    }
     local_particles.swap(new_particles);
+    profiler.end(Phase::Integrate);
   }
+  profiler.begin(Phase::Wait);
   MPI_Barrier(MPI_COMM_WORLD);
   double totalSimulationTime = totalSimulationTimer.elapsed();
+  profiler.end(Phase::Wait);
+  if (options.numIterations - first_step > ALLOC_WARMUP_ITERATIONS)
+    profiler.count(Counter::Allocations, heapAllocations() - allocations);
 
-  MPI_Allgatherv(
-    local_particles.data(), 
-    num_local_particles * sizeof(Particle),
-    MPI_BYTE,
-    particles.data(),
-    particle_list_sizes,
-    particle_list_displ,
-    MPI_BYTE,
-    MPI_COMM_WORLD);
-
-  if (pid == 0) {
-    std::vector<Particle> target;
-    target.resize(particles.size());
-    for (auto p : particles) {
-      int position = ord[p.id];
-      target[position] = p;
-    }
+  if (pid == COORDINATOR)
     printf("total simulation time: %.6fs\n", totalSimulationTime);
-    saveToFile(options.outputFile, target);
-  }
+  if (interval > 0 && options.numIterations % interval == 0 &&
+      options.numIterations > last_checkpoint)
+    checkpoints.write(local_particles.data(), local_particles.size(),
+                      num_particles, options.numIterations);
+  checkpoints.finish();
+  // every rank writes its own particles into the output file
+  saveParticlesDistributed(options.outputFile, local_particles,
+                           MPI_COMM_WORLD);
+  profiler.report(MPI_COMM_WORLD, options.profileFile);
 
+  MPI_Type_free(&ghost_type);
+  if (graph.comm != MPI_COMM_NULL)
+    MPI_Comm_free(&graph.comm);
   MPI_Finalize();
 }
@@ -0,0 +1,173 @@
+#ifndef NEIGHBOR_LIST_H
+#define NEIGHBOR_LIST_H
+
+#include "common.h"
+#include "force-kernel.h"
+#include "quad-tree.h"
+#include "thread-pool.h"
+#include <atomic>
+#include <cstring>
+
+// Verlet neighbor lists: for targets [first, first + numTargets) of a source
+// array, the sources within cullRadius + skin found with one QuadTree query
+// each. As long as no source has moved skin / 2 since the build, every pair
+// now within cullRadius is still on the lists, so forces can be evaluated
+// from the lists for several steps without touching the tree.
+class VerletList {
+public:
+  // cap on the stored indices (256 MB); dense scenes with large cull radii
+  // would otherwise need several GB, build() fails instead
+  static const size_t MaxIndices = (size_t)1 << 26;
+  // targets per thread pool task
+  static const size_t BuildGrain = 64;
+  // sources gathered per kernel call
+  static const int GatherBlock = 256;
+
+  size_t first = 0;
+  // sources of target first + t are indices[offsets[t], offsets[t + 1]),
+  // as indices into the source array
+  std::vector<int> offsets;
+  std::vector<int> indices;
+
+  explicit VerletList(float skin = 0.0f) : skin(skin) {}
+
+  float getSkin() const { return skin; }
+
+  // True unless the lists were built over these sources (same ids in the
+  // same order) and none of them has moved skin / 2 since.
+  bool needsRebuild(const std::vector<Particle> &sources) const {
+    if (!built || sources.size() != builtIds.size())
+      return true;
+    const float limit = 0.25f * skin * skin;
+    for (size_t i = 0; i < sources.size(); i++)
+      if (sources[i].id != builtIds[i] ||
+          (sources[i].position - builtPositions[i]).length2() >= limit)
+        return true;
+    return false;
+  }
+
+  // Builds the lists of targets [begin, end) of sources from tree, a tree over
+  // the same sources. Each worker appends its chunks' lists to its own buffer,
+  // and the buffers are copied into place once the counts are known. Returns
+  // false, leaving the lists unusable, if they would exceed MaxIndices.
+  bool build(const QuadTree &tree, const std::vector<Particle> &sources,
+             size_t begin, size_t end, float cullRadius, ThreadPool &pool) {
+    first = begin;
+    const float radius = cullRadius + skin, radius2 = radius * radius;
+    int maxId = -1;
+    for (auto &p : sources)
+      maxId = std::max(maxId, p.id);
+    sourceOfId.assign(maxId + 1, -1);
+    for (size_t i = 0; i < sources.size(); i++)
+      sourceOfId[sources[i].id] = (int)i;
+    // source index of every leaf slot, so whole leaves are copied at once
+    leafSource.resize(tree.leafParticles.size());
+    for (size_t k = 0; k < leafSource.size(); k++)
+      leafSource[k] = sourceOfId[tree.leafParticles[k].id];
+
+    offsets.assign(end - begin + 1, 0);
+    workerIndices.resize(pool.size());
+    workerChunks.resize(pool.size());
+    for (int w = 0; w < pool.size(); w++) {
+      workerIndices[w].clear();
+      workerChunks[w].clear();
+    }
+    std::atomic<size_t> total(0);
+    pool.parallelFor(begin, end, BuildGrain, [&](size_t b, size_t e, int w) {
+      if (total.load(std::memory_order_relaxed) > MaxIndices)
+        return;
+      auto &out = workerIndices[w];
+      workerChunks[w].push_back(Chunk{b, e, out.size()});
+      const size_t before = out.size();
+      for (size_t t = b; t < e; t++) {
+        const size_t last = out.size();
+        const Vec2 pos = sources[t].position;
+        tree.forEachLeaf(pos, radius, [&](const FlatQuadTreeNode &leaf,
+                                          bool inside) {
+          if (inside) {
+            out.insert(out.end(), leafSource.begin() + leaf.begin,
+                       leafSource.begin() + leaf.end);
+            return;
+          }
+          // any superset of the sources within radius will do, so compare
+          // squared distances on the SoA arrays
+          for (int k = leaf.begin; k < leaf.end; k++) {
+            const float dx = tree.leafX[k] - pos.x, dy = tree.leafY[k] - pos.y;
+            if (dx * dx + dy * dy <= radius2)
+              out.push_back(leafSource[k]);
+          }
+        });
+        offsets[t - begin + 1] = (int)(out.size() - last);
+      }
+      total += out.size() - before;
+    });
+    built = total.load() <= MaxIndices;
+    if (!built) {
+      indices.clear();
+      return false;
+    }
+
+    for (size_t t = 0; t < end - begin; t++)
+      offsets[t + 1] += offsets[t];
+    indices.resize(offsets.back());
+    for (int w = 0; w < pool.size(); w++)
+      for (const Chunk &c : workerChunks[w])
+        memcpy(indices.data() + offsets[c.begin - begin],
+               workerIndices[w].data() + c.from,
+               (offsets[c.end - begin] - offsets[c.begin - begin]) *
+                   sizeof(int));
+
+    builtIds.resize(sources.size());
+    builtPositions.resize(sources.size());
+    for (size_t i = 0; i < sources.size(); i++) {
+      builtIds[i] = sources[i].id;
+      builtPositions[i] = sources[i].position;
+    }
+    return true;
+  }
+
+  // Total force on sources[target] from its listed sources, the same sum as
+  // the exact per-step query: the kernel drops the listed sources that are
+  // not within cullRadius now. The sources are gathered in blocks into SoA
+  // buffers on the stack for the kernel. If visited is given, the number of
+  // sources evaluated is added to it.
+  Vec2 accumulateForce(const std::vector<Particle> &sources, size_t target,
+                       float cullRadius, ForceKernelFn kernel,
+                       int *visited = nullptr) const {
+    const Particle &p = sources[target];
+    const int b = offsets[target - first], e = offsets[target - first + 1];
+    float x[GatherBlock + QuadTreeSoAPadding] = {0.0f};
+    float y[GatherBlock + QuadTreeSoAPadding] = {0.0f};
+    float mass[GatherBlock + QuadTreeSoAPadding] = {0.0f};
+    Vec2 force(0.0f, 0.0f);
+    for (int k = b; k < e; k += GatherBlock) {
+      const int n = e - k < GatherBlock ? e - k : GatherBlock;
+      for (int i = 0; i < n; i++) {
+        const Particle &q = sources[indices[k + i]];
+        x[i] = q.position.x;
+        y[i] = q.position.y;
+        mass[i] = q.mass;
+      }
+      force += kernel(p.position, p.mass, x, y, mass, 0, n, cullRadius);
+    }
+    if (visited)
+      *visited += e - b;
+    return force;
+  }
+
+private:
+  // targets [begin, end) whose lists start at element from of a worker buffer
+  struct Chunk {
+    size_t begin, end, from;
+  };
+
+  float skin;
+  bool built = false;
+  std::vector<int> builtIds;
+  std::vector<Vec2> builtPositions;
+  std::vector<int> sourceOfId, leafSource;
+  std::vector<std::vector<int>> workerIndices;
+  std::vector<std::vector<Chunk>> workerChunks;
+};
+
+#endif
@@ -0,0 +1,573 @@
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include "common.h"
+#include "force-kernel.h"
+#include "morton.h"
+#include "mpi.h"
+#include "parallel-io.h"
+#include "particle-io.h"
+#include "profiler.h"
+#include "quad-tree.h"
+#include "thread-pool.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// -ooc <dir>: v2 for particle sets beyond the ranks' memory. Every rank keeps
+// the particles of its spatial region in a memory-mapped region file in dir
+// (on a file system all ranks share), cut into tiles of about tileParticles
+// spatially close particles. A step streams over the rank's tiles: a tile's
+// working set, its particles followed by the particles of any tile within
+// cullRadius of it (the halo, read straight from the other region files),
+// gets a QuadTree of its own, and the updated tile particles are written to
+// the next generation of the region file. A prefetch thread gathers the
+// next tile's working set while the current one is computed, so at most two
+// working sets are in memory. The prefetch thread makes no MPI calls.
+//
+// Tiles are contiguous runs of a 2^OutOfCoreCellBits x 2^OutOfCoreCellBits
+// grid of Morton cells over the global bounds, and ranks get contiguous runs
+// of tiles holding about N / nproc particles each. Between retilings
+// particles stay in their tile and the tile bounds follow them; retile()
+// sorts the particles back into cells, every rank writing its particles
+// straight to their new slots in the other ranks' files, so particles never
+// cross the network.
+
+const int OutOfCoreCellBits = 8;
+
+// one tile, the same table on every rank
+struct OutOfCoreTile {
+  Vec2 bmin, bmax;  // bounds of the tile's particles
+  long long offset; // first slot in the owner's region file
+  long long count;
+  int rank;
+};
+
+// A region file mapped as an array of Particles.
+class MappedRegion {
+public:
+  MappedRegion() {}
+  ~MappedRegion() { unmap(); }
+  MappedRegion(const MappedRegion &) = delete;
+  MappedRegion &operator=(const MappedRegion &) = delete;
+  MappedRegion(MappedRegion &&other) : particles(other.particles), n(other.n) {
+    other.particles = nullptr;
+    other.n = 0;
+  }
+
+  // Maps count Particles of fileName, writable ones after sizing the file
+  // for them.
+  void map(const std::string &fileName, size_t count, bool writable) {
+    unmap();
+    n = count;
+    if (count == 0)
+      return;
+    int fd = open(fileName.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY,
+                  0644);
+    assert(fd >= 0 && "Cannot open region file");
+    if (writable) {
+      int err = ftruncate(fd, count * sizeof(Particle));
+      assert(err == 0 && "Cannot size region file");
+      (void)err;
+    }
+    void *addr = mmap(nullptr, count * sizeof(Particle),
+                      writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    assert(addr != MAP_FAILED && "Cannot map region file");
+    particles = (Particle *)addr;
+  }
+
+  void unmap() {
+    if (particles)
+      munmap(particles, n * sizeof(Particle));
+    particles = nullptr;
+    n = 0;
+  }
+
+  // writes the dirty pages back before other ranks read the file
+  void sync() {
+    if (particles)
+      msync(particles, n * sizeof(Particle), MS_SYNC);
+  }
+
+  Particle *data() const { return particles; }
+  size_t size() const { return n; }
+
+private:
+  Particle *particles = nullptr;
+  size_t n = 0;
+};
+
+class OutOfCoreSimulation {
+public:
+  OutOfCoreSimulation(const std::string &dir, int tileParticles,
+                      StepParameters params, ForceKernelFn kernel,
+                      ThreadPool &pool, PhaseProfiler &profiler,
+                      MPI_Comm comm)
+      : dir(dir), tileParticles(std::max(tileParticles, 1)), params(params),
+        kernel(kernel), pool(pool), profiler(profiler), comm(comm) {
+    MPI_Comm_rank(comm, &pid);
+    MPI_Comm_size(comm, &nproc);
+    sources.resize(nproc);
+  }
+
+  ~OutOfCoreSimulation() {
+    if (worker.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+      }
+      wake.notify_all();
+      worker.join();
+    }
+    for (auto &s : sources)
+      s.unmap();
+    next.unmap();
+    for (int g = 0; g < 2; g++)
+      unlink(regionFileName(pid, g).c_str());
+  }
+
+  OutOfCoreSimulation(const OutOfCoreSimulation &) = delete;
+  OutOfCoreSimulation &operator=(const OutOfCoreSimulation &) = delete;
+
+  // Collective. Streams this rank's share of the input file into its region
+  // file, in chunks of a tile for binary files, and tiles the particles.
+  void load(const std::string &fileName) {
+    long long count = 0;
+    if (isBinaryParticleFile(fileName)) {
+      int fd = open(fileName.c_str(), O_RDONLY);
+      assert(fd >= 0 && "Cannot open input file");
+      ParticleFileHeader header;
+      ssize_t got = pread(fd, &header, sizeof(header), 0);
+      assert(got == (ssize_t)sizeof(header) && isBinaryHeader(header) &&
+             "Not a binary particle file");
+      (void)got;
+      const long long n = header.count;
+      const long long first = n * pid / nproc, last = n * (pid + 1) / nproc;
+      count = last - first;
+      next.map(regionFileName(pid, 0), count, true);
+      std::vector<ParticleRecord> records(tileParticles);
+      for (long long b = first; b < last; b += tileParticles) {
+        const long long e = std::min(b + tileParticles, last);
+        const size_t bytes = (e - b) * sizeof(ParticleRecord);
+        got = pread(fd, records.data(), bytes,
+                    sizeof(header) + b * sizeof(ParticleRecord));
+        assert(got == (ssize_t)bytes && "Truncated particle file");
+        for (long long i = b; i < e; i++)
+          next.data()[i - first] = fromRecord(records[i - b], (int)i);
+      }
+      close(fd);
+    } else {
+      // text files are parsed whole, only binary ones stream
+      std::vector<Particle> share;
+      loadParticlesDistributed(fileName, share, comm);
+      count = share.size();
+      next.map(regionFileName(pid, 0), count, true);
+      std::copy(share.begin(), share.end(), next.data());
+    }
+    MPI_Allreduce(&count, &total, 1, MPI_LONG_LONG, MPI_SUM, comm);
+
+    // one tile per rank until the first retiling
+    OutOfCoreTile own;
+    own.bmin = Vec2(1e30f, 1e30f);
+    own.bmax = Vec2(-1e30f, -1e30f);
+    for (long long i = 0; i < count; i++)
+      growBounds(own.bmin, own.bmax, next.data()[i].position);
+    own.offset = 0;
+    own.count = count;
+    own.rank = pid;
+    tiles.resize(nproc);
+    MPI_Allgather(&own, sizeof(own), MPI_BYTE, tiles.data(), sizeof(own),
+                  MPI_BYTE, comm);
+    next.sync();
+    next.unmap();
+    generation = 0;
+    mapSources();
+    retile();
+  }
+
+  // Collective: moves every particle by one step.
+  void step() {
+    const int first = firstTile(), last = firstTile(pid + 1);
+    long long count = 0;
+    for (int t = first; t < last; t++)
+      count += tiles[t].count;
+    next.map(regionFileName(pid, 1 - generation), count, true);
+    nextBounds.resize(last - first);
+
+    if (!worker.joinable())
+      worker = std::thread([this] { run(); });
+    if (first < last)
+      prefetch(first);
+    for (int t = first; t < last; t++) {
+      profiler.begin(Phase::Wait);
+      waitForPrefetch();
+      profiler.end(Phase::Wait);
+      current.swap(prefetched);
+      if (t + 1 < last)
+        prefetch(t + 1);
+      simulateTile(t, current, nextBounds[t - first]);
+    }
+
+    // the gather only completes once every rank has written its file
+    profiler.begin(Phase::Exchange);
+    next.sync();
+    next.unmap();
+    std::vector<bound> all(tiles.size());
+    gatherOwnTiles(nextBounds, all);
+    for (size_t t = 0; t < tiles.size(); t++) {
+      tiles[t].bmin = all[t].bmin;
+      tiles[t].bmax = all[t].bmax;
+    }
+    generation = 1 - generation;
+    mapSources();
+    profiler.end(Phase::Exchange);
+  }
+
+  // Collective: sorts the particles back into tiles of close particles,
+  // balanced over the ranks.
+  void retile() {
+    profiler.begin(Phase::Redistribute);
+    float lo[2] = {1e30f, 1e30f}, hi[2] = {-1e30f, -1e30f};
+    for (const OutOfCoreTile &tile : tiles) {
+      if (tile.count == 0)
+        continue;
+      lo[0] = fminf(lo[0], tile.bmin.x);
+      lo[1] = fminf(lo[1], tile.bmin.y);
+      hi[0] = fmaxf(hi[0], tile.bmax.x);
+      hi[1] = fmaxf(hi[1], tile.bmax.y);
+    }
+    const Vec2 gmin(lo[0], lo[1]);
+    const Vec2 scale = mortonScale(gmin, Vec2(hi[0], hi[1]));
+    const int numCells = 1 << (2 * OutOfCoreCellBits);
+    const int shift = 2 * (MortonBitsPerAxis - OutOfCoreCellBits);
+    auto cellOf = [&](const Particle &p) {
+      return (int)(mortonKey(p.position, gmin, scale) >> shift);
+    };
+
+    // this rank's particles per cell, those of the lower ranks and all
+    const int first = firstTile(), last = firstTile(pid + 1);
+    const Particle *own = sources[pid].data();
+    cellCount.assign(numCells, 0);
+    for (int t = first; t < last; t++)
+      for (long long i = 0; i < tiles[t].count; i++)
+        cellCount[cellOf(own[tiles[t].offset + i])]++;
+    cellBefore.assign(numCells, 0);
+    cellTotal.resize(numCells);
+    MPI_Exscan(cellCount.data(), cellBefore.data(), numCells, MPI_LONG_LONG,
+               MPI_SUM, comm);
+    if (pid == 0)
+      std::fill(cellBefore.begin(), cellBefore.end(), 0);
+    MPI_Allreduce(cellCount.data(), cellTotal.data(), numCells, MPI_LONG_LONG,
+                  MPI_SUM, comm);
+
+    // every rank cuts the same tiles from the totals
+    std::vector<OutOfCoreTile> newTiles;
+    cellTile.resize(numCells);
+    cellSlot.resize(numCells);
+    long long before = 0, slot = 0;
+    for (int c = 0; c < numCells; c++) {
+      const long long n = cellTotal[c];
+      const int r = (int)std::min(
+          (long long)nproc - 1,
+          (before + n / 2) * nproc / std::max(total, 1LL));
+      if (newTiles.empty() || newTiles.back().rank != r)
+        slot = 0;
+      if (newTiles.empty() || newTiles.back().rank != r ||
+          (newTiles.back().count > 0 &&
+           newTiles.back().count + n > tileParticles)) {
+        OutOfCoreTile tile;
+        tile.bmin = Vec2(1e30f, 1e30f);
+        tile.bmax = Vec2(-1e30f, -1e30f);
+        tile.offset = slot;
+        tile.count = 0;
+        tile.rank = r;
+        newTiles.push_back(tile);
+      }
+      cellTile[c] = (int)newTiles.size() - 1;
+      cellSlot[c] = slot;
+      newTiles.back().count += n;
+      slot += n;
+      before += n;
+    }
+
+    // every rank sizes its own next region file before the others write
+    const int nextGeneration = 1 - generation;
+    long long newCount = 0;
+    for (const OutOfCoreTile &tile : newTiles)
+      if (tile.rank == pid)
+        newCount += tile.count;
+    {
+      int fd = open(regionFileName(pid, nextGeneration).c_str(),
+                    O_RDWR | O_CREAT, 0644);
+      assert(fd >= 0 && "Cannot open region file");
+      int err = ftruncate(fd, newCount * sizeof(Particle));
+      assert(err == 0 && "Cannot size region file");
+      (void)err;
+      close(fd);
+    }
+    MPI_Barrier(comm);
+
+    // every tile's particles sorted by cell, each run of a cell written to
+    // its slots
+    std::vector<int> fds(nproc, -1);
+    std::vector<bound> newBounds(newTiles.size(),
+                                 bound{Vec2(1e30f, 1e30f),
+                                       Vec2(-1e30f, -1e30f)});
+    long long migrated = 0;
+    for (int t = first; t < last; t++) {
+      const Particle *p = own + tiles[t].offset;
+      byCell.resize(tiles[t].count);
+      for (long long i = 0; i < tiles[t].count; i++)
+        byCell[i] = std::make_pair(cellOf(p[i]), p[i]);
+      std::stable_sort(byCell.begin(), byCell.end(),
+                       [](const std::pair<int, Particle> &a,
+                          const std::pair<int, Particle> &b) {
+                         return a.first < b.first;
+                       });
+      for (size_t b = 0, e; b < byCell.size(); b = e) {
+        const int c = byCell[b].first;
+        for (e = b + 1; e < byCell.size() && byCell[e].first == c; e++)
+          ;
+        cellRun.resize(e - b);
+        bound &bounds = newBounds[cellTile[c]];
+        for (size_t i = b; i < e; i++) {
+          cellRun[i - b] = byCell[i].second;
+          growBounds(bounds.bmin, bounds.bmax, cellRun[i - b].position);
+        }
+        const int r = newTiles[cellTile[c]].rank;
+        if (fds[r] < 0) {
+          fds[r] = open(regionFileName(r, nextGeneration).c_str(), O_WRONLY);
+          assert(fds[r] >= 0 && "Cannot open region file");
+        }
+        writeFully(fds[r], cellRun.data(), cellRun.size() * sizeof(Particle),
+                   (off_t)(cellSlot[c] + cellBefore[c]) * sizeof(Particle));
+        cellBefore[c] += e - b;
+        if (r != pid)
+          migrated += e - b;
+      }
+    }
+    for (int fd : fds)
+      if (fd >= 0)
+        close(fd);
+    byCell.clear();
+    byCell.shrink_to_fit();
+    profiler.count(Counter::ParticlesMigrated, migrated);
+
+    // the reduction only completes once every rank has written
+    std::vector<float> boundsLo(2 * newTiles.size()),
+        boundsHi(2 * newTiles.size());
+    for (size_t t = 0; t < newTiles.size(); t++) {
+      boundsLo[2 * t] = newBounds[t].bmin.x;
+      boundsLo[2 * t + 1] = newBounds[t].bmin.y;
+      boundsHi[2 * t] = newBounds[t].bmax.x;
+      boundsHi[2 * t + 1] = newBounds[t].bmax.y;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, boundsLo.data(), boundsLo.size(), MPI_FLOAT,
+                  MPI_MIN, comm);
+    MPI_Allreduce(MPI_IN_PLACE, boundsHi.data(), boundsHi.size(), MPI_FLOAT,
+                  MPI_MAX, comm);
+    for (size_t t = 0; t < newTiles.size(); t++) {
+      newTiles[t].bmin = Vec2(boundsLo[2 * t], boundsLo[2 * t + 1]);
+      newTiles[t].bmax = Vec2(boundsHi[2 * t], boundsHi[2 * t + 1]);
+    }
+    tiles.swap(newTiles);
+    generation = nextGeneration;
+    mapSources();
+    profiler.end(Phase::Redistribute);
+  }
+
+  // Collective: writes the particles in id order, streaming tile by tile
+  // for binary files. Text files are assembled in memory like
+  // saveParticlesDistributed.
+  void save(const std::string &fileName) {
+    const int first = firstTile(), last = firstTile(pid + 1);
+    const Particle *own = sources[pid].data();
+    if (!isBinaryFileName(fileName)) {
+      std::vector<Particle> particles(own, own + sources[pid].size());
+      saveParticlesDistributed(fileName, particles, comm);
+      return;
+    }
+    int fd = open(fileName.c_str(), O_WRONLY | O_CREAT, 0644);
+    assert(fd >= 0 && "Cannot open output file");
+    if (pid == 0)
+      writeBinaryHeader(fd, total);
+    std::vector<ParticleRecord> records;
+    for (int t = first; t < last; t++) {
+      current.assign(own + tiles[t].offset,
+                     own + tiles[t].offset + tiles[t].count);
+      std::sort(current.begin(), current.end(),
+                [](const Particle &a, const Particle &b) {
+                  return a.id < b.id;
+                });
+      writeRecordsById(fd, current.data(), current.size(), records);
+    }
+    close(fd);
+    MPI_Barrier(comm);
+  }
+
+private:
+  struct bound {
+    Vec2 bmin, bmax;
+  };
+
+  std::string dir;
+  long long tileParticles;
+  StepParameters params;
+  ForceKernelFn kernel;
+  ThreadPool &pool;
+  PhaseProfiler &profiler;
+  MPI_Comm comm;
+  int pid, nproc;
+  long long total = 0;
+
+  // tiles of all ranks, in rank order; the region files of generation hold
+  // the current particles, mapped read-only in sources
+  std::vector<OutOfCoreTile> tiles;
+  int generation = 0;
+  std::vector<MappedRegion> sources;
+  // this rank's next generation and the bounds of its updated tiles
+  MappedRegion next;
+  std::vector<bound> nextBounds;
+
+  // working sets: the one computed, and the one the prefetch thread fills
+  std::vector<Particle> current, prefetched;
+  QuadTree tree;
+  std::vector<int> visited;
+
+  // retile() scratch
+  std::vector<long long> cellCount, cellBefore, cellTotal, cellSlot;
+  std::vector<int> cellTile;
+  std::vector<std::pair<int, Particle>> byCell;
+  std::vector<Particle> cellRun;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  int request = -1;
+  bool busy = false, stop = false;
+
+  std::string regionFileName(int rank, int gen) const {
+    return dir + "/region-" + std::to_string(rank) + "-" +
+           std::to_string(gen) + ".dat";
+  }
+
+  static void growBounds(Vec2 &bmin, Vec2 &bmax, Vec2 p) {
+    bmin.x = fminf(bmin.x, p.x);
+    bmin.y = fminf(bmin.y, p.y);
+    bmax.x = fmaxf(bmax.x, p.x);
+    bmax.y = fmaxf(bmax.y, p.y);
+  }
+
+  // first tile of rank (tiles are in rank order), tiles.size() past the last
+  int firstTile(int rank) const {
+    int t = 0;
+    while (t < (int)tiles.size() && tiles[t].rank < rank)
+      t++;
+    return t;
+  }
+  int firstTile() const { return firstTile(pid); }
+
+  // after the files of generation are complete
+  void mapSources() {
+    for (int r = 0; r < nproc; r++) {
+      long long count = 0;
+      for (int t = firstTile(r); t < firstTile(r + 1); t++)
+        count += tiles[t].count;
+      sources[r].map(regionFileName(r, generation), count, false);
+    }
+  }
+
+  // bounds of every rank's own tiles to every rank
+  void gatherOwnTiles(const std::vector<bound> &own, std::vector<bound> &all) {
+    std::vector<int> counts(nproc), displs(nproc);
+    for (int r = 0; r < nproc; r++) {
+      displs[r] = firstTile(r) * sizeof(bound);
+      counts[r] = (firstTile(r + 1) - firstTile(r)) * sizeof(bound);
+    }
+    MPI_Allgatherv(own.data(), own.size() * sizeof(bound), MPI_BYTE,
+                   all.data(), counts.data(), displs.data(), MPI_BYTE, comm);
+  }
+
+  // tile t's particles, then every particle of other tiles within
+  // cullRadius of its bounds
+  void gatherWorkingSet(int t, std::vector<Particle> &out) const {
+    const OutOfCoreTile &tile = tiles[t];
+    const Particle *own = sources[tile.rank].data() + tile.offset;
+    reserveWithSlack(out, tile.count);
+    out.assign(own, own + tile.count);
+    const float r = params.cullRadius;
+    for (size_t u = 0; u < tiles.size(); u++) {
+      const OutOfCoreTile &other = tiles[u];
+      if ((int)u == t || other.count == 0 ||
+          boxBoxDistance(tile.bmin, tile.bmax, other.bmin, other.bmax) > r)
+        continue;
+      const Particle *p = sources[other.rank].data() + other.offset;
+      for (long long i = 0; i < other.count; i++)
+        if (boxPointDistance(tile.bmin, tile.bmax, p[i].position) <= r)
+          out.push_back(p[i]);
+    }
+  }
+
+  void prefetch(int t) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      request = t;
+      busy = true;
+    }
+    wake.notify_all();
+  }
+
+  void waitForPrefetch() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return !busy; });
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      wake.wait(lock, [this] { return busy || stop; });
+      if (stop)
+        return;
+      lock.unlock();
+      gatherWorkingSet(request, prefetched);
+      lock.lock();
+      busy = false;
+      done.notify_all();
+    }
+  }
+
+  // forces on tile t's particles from the working set ws, updated into the
+  // next region file
+  void simulateTile(int t, std::vector<Particle> &ws, bound &bounds) {
+    const OutOfCoreTile &tile = tiles[t];
+    profiler.begin(Phase::Build);
+    QuadTree::buildQuadTree(ws, tree, pool);
+    if (params.theta > 0.0f)
+      tree.summarize();
+    profiler.count(Counter::TreeRebuilds, 1);
+    profiler.end(Phase::Build);
+
+    profiler.begin(Phase::Force);
+    Particle *out = next.data() + tile.offset;
+    visited.assign(pool.size(), 0);
+    pool.parallelFor(0, tile.count, 64, [&](size_t b, size_t e, int w) {
+      int count = 0;
+      for (size_t j = b; j < e; j++) {
+        Vec2 force = accumulateForce(tree, ws[j], params, kernel, &count);
+        out[j] = updateParticle(ws[j], force, params.deltaTime);
+      }
+      visited[w] += count;
+    });
+    for (int v : visited)
+      profiler.count(Counter::NeighborsVisited, v);
+    profiler.count(Counter::ForceEvaluations, tile.count);
+    bounds = bound{Vec2(1e30f, 1e30f), Vec2(-1e30f, -1e30f)};
+    for (long long j = 0; j < tile.count; j++)
+      growBounds(bounds.bmin, bounds.bmax, out[j].position);
+    profiler.end(Phase::Force);
+  }
+};
+
+#endif
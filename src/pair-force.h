@@ -0,0 +1,111 @@
+#ifndef PAIR_FORCE_H
+#define PAIR_FORCE_H
+
+#include "common.h"
+#include "force-kernel.h"
+#include "quad-tree.h"
+#include "thread-pool.h"
+#include <algorithm>
+
+// Forces between all pairs of a tree's particles within cullRadius with every
+// pair evaluated once: computeForce is antisymmetric in its arguments, so the
+// force on the attractor is the negated force on the target. Leaves are
+// walked in pool order, and each leaf a is paired with itself and with the
+// leaves b > a whose bounds come within cullRadius of its own; a pair kernel
+// runs every particle of a against the SoA range of b. Every worker scatters
+// into its own per-slot SoA accumulators, which finish() sums.
+class PairForceAccumulator {
+public:
+  // Starts a pass over tree, clearing the accumulators.
+  void begin(const QuadTree &tree, ThreadPool &pool) {
+    leaves.clear();
+    leaves.reserve(tree.nodes.capacity());
+    for (int n = 0; n < (int)tree.nodes.size(); n++)
+      if (tree.nodes[n].isLeaf() && tree.nodes[n].size() > 0)
+        leaves.push_back(n);
+    const size_t n = tree.leafParticles.size();
+    forceX.resize(pool.size());
+    forceY.resize(pool.size());
+    costs.resize(pool.size());
+    for (int w = 0; w < pool.size(); w++) {
+      reserveWithSlack(forceX[w], n + QuadTreeSoAPadding);
+      reserveWithSlack(forceY[w], n + QuadTreeSoAPadding);
+      reserveWithSlack(costs[w], n);
+      forceX[w].assign(n + QuadTreeSoAPadding, 0.0f);
+      forceY[w].assign(n + QuadTreeSoAPadding, 0.0f);
+      costs[w].assign(n, 0.0f);
+    }
+  }
+
+  size_t numLeaves() const { return leaves.size(); }
+
+  // Evaluates the pairs whose first leaf is one of leaves [begin, end) of the
+  // pass, so a caller can interleave other work between blocks of leaves.
+  void accumulate(const QuadTree &tree, size_t begin, size_t end,
+                  float cullRadius, PairForceKernelFn kernel,
+                  ThreadPool &pool) {
+    pool.parallelFor(begin, end, 1, [&](size_t b, size_t e, int w) {
+      float *fx = forceX[w].data(), *fy = forceY[w].data();
+      float *cost = costs[w].data();
+      for (size_t l = b; l < e; l++) {
+        const int a = leaves[l];
+        const FlatQuadTreeNode &leaf = tree.nodes[a];
+        tree.forEachLeafNearBox(leaf.bmin, leaf.bmax, cullRadius, [&](int o) {
+          if (o >= a)
+            accumulateLeafPair(tree, leaf, tree.nodes[o], o == a, cullRadius,
+                               kernel, fx, fy, cost);
+        });
+      }
+    });
+  }
+
+  // Calls f(slot, force, cost) for every slot of tree.leafParticles with its
+  // total force and its share of the evaluations (half a pair per endpoint).
+  template <typename F> void finish(const QuadTree &tree, F &&f) const {
+    for (size_t k = 0; k < tree.leafParticles.size(); k++) {
+      Vec2 force(0.0f, 0.0f);
+      float cost = 0.0f;
+      for (size_t w = 0; w < costs.size(); w++) {
+        force += Vec2(forceX[w][k], forceY[w][k]);
+        cost += costs[w][k];
+      }
+      f((int)k, force, cost);
+    }
+  }
+
+private:
+  std::vector<int> leaves;
+  // per worker, indexed by leaf slot; forces padded for the pair kernels
+  std::vector<std::vector<float>> forceX, forceY;
+  std::vector<std::vector<float>> costs;
+
+  static void accumulateLeafPair(const QuadTree &tree,
+                                 const FlatQuadTreeNode &a,
+                                 const FlatQuadTreeNode &b, bool same,
+                                 float cullRadius, PairForceKernelFn kernel,
+                                 float *fx, float *fy, float *cost) {
+    const float *x = tree.leafX.data(), *y = tree.leafY.data();
+    const float *mass = tree.leafMass.data();
+    for (int i = a.begin; i < a.end; i++) {
+      const int first = same ? i + 1 : b.begin;
+      if (first >= b.end)
+        continue;
+      Vec2 f = kernel(Vec2(x[i], y[i]), mass[i], x, y, mass, first, b.end,
+                      cullRadius, fx, fy);
+      fx[i] += f.x;
+      fy[i] += f.y;
+    }
+    // every particle's pairs: the rest of its leaf, or the other leaf
+    if (same) {
+      for (int i = a.begin; i < a.end; i++)
+        cost[i] += 0.5f * (float)(a.size() - 1);
+      return;
+    }
+    for (int i = a.begin; i < a.end; i++)
+      cost[i] += 0.5f * (float)b.size();
+    for (int j = b.begin; j < b.end; j++)
+      cost[j] += 0.5f * (float)a.size();
+  }
+};
+
+#endif
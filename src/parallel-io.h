@@ -0,0 +1,230 @@
+#ifndef PARALLEL_IO_H
+#define PARALLEL_IO_H
+
+#include "common.h"
+#include "mpi.h"
+#include "particle-io.h"
+#include <algorithm>
+#include <sstream>
+
+// Collective particle file I/O with MPI-IO: every rank reads and writes only
+// its own part of the file, in either format of particle-io.h.
+
+// longest text line the chunked reader expects, see loadTextShare
+const int ParticleTextMaxLine = 4096;
+
+inline void openParticleFile(const std::string &fileName, int mode,
+                             MPI_Comm comm, MPI_File &fh) {
+  int err = MPI_File_open(comm, fileName.c_str(), mode, MPI_INFO_NULL, &fh);
+  assert(err == MPI_SUCCESS && "Cannot open particle file");
+  (void)err;
+}
+
+// Binary files: rank r reads records [N * r / nproc, N * (r + 1) / nproc).
+inline void loadBinaryShare(MPI_File fh, const ParticleFileHeader &header,
+                            std::vector<Particle> &particles, int pid,
+                            int nproc) {
+  const long long n = header.count;
+  const long long first = n * pid / nproc, last = n * (pid + 1) / nproc;
+  std::vector<ParticleRecord> records(last - first);
+  MPI_File_read_at_all(fh, sizeof(header) + first * sizeof(ParticleRecord),
+                       records.data(),
+                       (int)(records.size() * sizeof(ParticleRecord)),
+                       MPI_BYTE, MPI_STATUS_IGNORE);
+  particles.resize(records.size());
+  for (size_t i = 0; i < records.size(); i++)
+    particles[i] = fromRecord(records[i], (int)(first + i));
+}
+
+// Text files: rank r reads bytes [size * r / nproc, size * (r + 1) / nproc)
+// and parses the lines that start in that range, reading on to the end of
+// its last line. Line ids are offset by the lines of the lower ranks.
+inline void loadTextShare(MPI_File fh, std::vector<Particle> &particles,
+                          int pid, int nproc, MPI_Comm comm) {
+  MPI_Offset size;
+  MPI_File_get_size(fh, &size);
+  const MPI_Offset begin = size * pid / nproc;
+  const MPI_Offset end = size * (pid + 1) / nproc;
+  // one byte before begin tells whether a line starts at begin
+  const MPI_Offset from = begin > 0 ? begin - 1 : 0;
+  const MPI_Offset to = std::min(end + ParticleTextMaxLine, size);
+  std::vector<char> buf(to - from + 1);
+  MPI_File_read_at_all(fh, from, buf.data(), (int)(to - from), MPI_BYTE,
+                       MPI_STATUS_IGNORE);
+  buf[to - from] = '\0';
+
+  particles.clear();
+  const char *p = buf.data();
+  const char *chunkEnd = buf.data() + (end - from);
+  // at most one particle per line ending in the range, plus a last line
+  // that runs past it
+  particles.reserve(std::count(p, chunkEnd, '\n') + 1);
+  if (begin > 0) {
+    // skip to the first line starting at or after begin
+    while (*p && *p != '\n')
+      p++;
+    if (*p)
+      p++;
+  }
+  while (p < chunkEnd && *p) {
+    Particle particle;
+    char *next;
+    particle.mass = strtof(p, &next);
+    particle.position.x = strtof(next, &next);
+    particle.position.y = strtof(next, &next);
+    particle.velocity.x = strtof(next, &next);
+    particle.velocity.y = strtof(next, &next);
+    particles.push_back(particle);
+    p = next;
+    while (*p && *p != '\n')
+      p++;
+    assert((*p || to == size) && "Particle file line too long");
+    if (*p)
+      p++;
+  }
+
+  int count = (int)particles.size(), firstId = 0;
+  MPI_Exscan(&count, &firstId, 1, MPI_INT, MPI_SUM, comm);
+  if (pid == 0)
+    firstId = 0;
+  for (int i = 0; i < count; i++)
+    particles[i].id = firstId + i;
+}
+
+// Collective over comm. Each rank gets a contiguous share of about N / nproc
+// of the file's particles, ids set as loadFromFile sets them.
+inline void loadParticlesDistributed(const std::string &fileName,
+                                     std::vector<Particle> &particles,
+                                     MPI_Comm comm) {
+  int pid, nproc;
+  MPI_Comm_rank(comm, &pid);
+  MPI_Comm_size(comm, &nproc);
+  MPI_File fh;
+  openParticleFile(fileName, MPI_MODE_RDONLY, comm, fh);
+  ParticleFileHeader header;
+  MPI_Offset size;
+  MPI_File_get_size(fh, &size);
+  bool binary = size >= (MPI_Offset)sizeof(header);
+  if (binary) {
+    MPI_File_read_at_all(fh, 0, &header, sizeof(header), MPI_BYTE,
+                         MPI_STATUS_IGNORE);
+    binary = isBinaryHeader(header);
+  }
+  if (binary)
+    loadBinaryShare(fh, header, particles, pid, nproc);
+  else
+    loadTextShare(fh, particles, pid, nproc, comm);
+  MPI_File_close(&fh);
+}
+
+// Moves the particles so that rank r holds ids [N * r / nproc,
+// N * (r + 1) / nproc) in id order, where N is the total particle count.
+inline void redistributeById(std::vector<Particle> &particles, MPI_Comm comm,
+                             long long &first, long long &total) {
+  int pid, nproc;
+  MPI_Comm_rank(comm, &pid);
+  MPI_Comm_size(comm, &nproc);
+  long long count = particles.size();
+  MPI_Allreduce(&count, &total, 1, MPI_LONG_LONG, MPI_SUM, comm);
+  const long long n = total;
+  auto ownerOf = [&](int id) {
+    // largest r with n * r / nproc <= id
+    int r = std::min((int)((long long)id * nproc / std::max(n, 1LL)),
+                     nproc - 1);
+    while (r > 0 && n * r / nproc > id)
+      r--;
+    while (r < nproc - 1 && n * (r + 1) / nproc <= id)
+      r++;
+    return r;
+  };
+
+  std::vector<int> sendBytes(nproc, 0), sendDispl(nproc), recvBytes(nproc),
+      recvDispl(nproc);
+  for (auto &p : particles)
+    sendBytes[ownerOf(p.id)] += sizeof(Particle);
+  for (int r = 0, acc = 0; r < nproc; r++) {
+    sendDispl[r] = acc;
+    acc += sendBytes[r];
+  }
+  std::vector<Particle> sendBuf(particles.size());
+  std::vector<int> offset(sendDispl);
+  for (auto &p : particles) {
+    int r = ownerOf(p.id);
+    sendBuf[offset[r] / sizeof(Particle)] = p;
+    offset[r] += sizeof(Particle);
+  }
+  MPI_Alltoall(sendBytes.data(), 1, MPI_INT, recvBytes.data(), 1, MPI_INT,
+               comm);
+  int received = 0;
+  for (int r = 0; r < nproc; r++) {
+    recvDispl[r] = received;
+    received += recvBytes[r];
+  }
+  std::vector<Particle> recvBuf(received / sizeof(Particle));
+  MPI_Alltoallv(sendBuf.data(), sendBytes.data(), sendDispl.data(), MPI_BYTE,
+                recvBuf.data(), recvBytes.data(), recvDispl.data(), MPI_BYTE,
+                comm);
+
+  first = n * pid / nproc;
+  particles.resize(n * (pid + 1) / nproc - first);
+  for (auto &p : recvBuf)
+    particles[p.id - first] = p;
+}
+
+// Collective over comm: writes the particles of all ranks (each particle on
+// exactly one rank) to fileName in id order, in the format saveParticles
+// would pick. particles is left holding this rank's id range.
+inline void saveParticlesDistributed(const std::string &fileName,
+                                     std::vector<Particle> &particles,
+                                     MPI_Comm comm) {
+  int pid;
+  MPI_Comm_rank(comm, &pid);
+  long long first, total;
+  redistributeById(particles, comm, first, total);
+
+  std::vector<char> buf;
+  MPI_Offset offset, size;
+  if (isBinaryFileName(fileName)) {
+    const size_t headerBytes = pid == 0 ? sizeof(ParticleFileHeader) : 0;
+    buf.resize(headerBytes + particles.size() * sizeof(ParticleRecord));
+    if (pid == 0) {
+      ParticleFileHeader *header = (ParticleFileHeader *)buf.data();
+      memcpy(header->magic, ParticleFileMagic, 4);
+      header->version = ParticleFileVersion;
+      header->count = total;
+    }
+    ParticleRecord *records = (ParticleRecord *)(buf.data() + headerBytes);
+    for (size_t i = 0; i < particles.size(); i++)
+      records[i] = toRecord(particles[i]);
+    offset = pid == 0 ? 0
+                      : sizeof(ParticleFileHeader) +
+                            first * (MPI_Offset)sizeof(ParticleRecord);
+    size = sizeof(ParticleFileHeader) + total * sizeof(ParticleRecord);
+  } else {
+    // same formatting as saveToFile
+    std::ostringstream f;
+    f << std::setprecision(9);
+    for (auto &p : particles)
+      f << p.mass << " " << p.position.x << " " << p.position.y << " "
+        << p.velocity.x << " " << p.velocity.y << '\n';
+    const std::string text = f.str();
+    buf.assign(text.begin(), text.end());
+    long long bytes = buf.size(), before = 0, all;
+    MPI_Exscan(&bytes, &before, 1, MPI_LONG_LONG, MPI_SUM, comm);
+    if (pid == 0)
+      before = 0;
+    MPI_Allreduce(&bytes, &all, 1, MPI_LONG_LONG, MPI_SUM, comm);
+    offset = before;
+    size = all;
+  }
+
+  MPI_File fh;
+  openParticleFile(fileName, MPI_MODE_WRONLY | MPI_MODE_CREATE, comm, fh);
+  // drop the tail of an older, longer file
+  MPI_File_set_size(fh, size);
+  MPI_File_write_at_all(fh, offset, buf.data(), (int)buf.size(), MPI_BYTE,
+                        MPI_STATUS_IGNORE);
+  MPI_File_close(&fh);
+}
+
+#endif
@@ -0,0 +1,22 @@
+#include "common.h"
+#include "particle-io.h"
+#include <cstdio>
+
+// Converts particle files between the text and the binary format. The input
+// format is detected from its header, the output is the other one.
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <input> <output>\n", argv[0]);
+    return 1;
+  }
+  std::vector<Particle> particles;
+  if (isBinaryParticleFile(argv[1])) {
+    loadFromBinaryFile(argv[1], particles);
+    saveToFile(argv[2], particles);
+  } else {
+    loadFromFile(argv[1], particles);
+    saveToBinaryFile(argv[2], particles);
+  }
+  printf("converted %zu particles\n", particles.size());
+  return 0;
+}
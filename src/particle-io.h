@@ -0,0 +1,172 @@
+#ifndef PARTICLE_IO_H
+#define PARTICLE_IO_H
+
+#include "common.h"
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Binary particle files: a ParticleFileHeader followed by count packed
+// ParticleRecords, in the same order and with the same fields as the lines of
+// the text format. As there, a particle's id is its index in the file.
+struct ParticleFileHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t count;
+};
+
+struct ParticleRecord {
+  float mass;
+  float x, y;
+  float vx, vy;
+};
+
+static_assert(sizeof(ParticleFileHeader) == 16, "header must be packed");
+static_assert(sizeof(ParticleRecord) == 20, "records must be packed");
+
+const char ParticleFileMagic[4] = {'N', 'B', 'P', 'F'};
+const uint32_t ParticleFileVersion = 1;
+
+inline bool isBinaryHeader(const ParticleFileHeader &header) {
+  return memcmp(header.magic, ParticleFileMagic, 4) == 0 &&
+         header.version == ParticleFileVersion;
+}
+
+// True if fileName starts with a binary particle file header.
+inline bool isBinaryParticleFile(const std::string &fileName) {
+  ParticleFileHeader header;
+  std::ifstream f(fileName, std::ios::binary);
+  return f.read((char *)&header, sizeof(header)) && isBinaryHeader(header);
+}
+
+inline Particle fromRecord(const ParticleRecord &r, int id) {
+  Particle p;
+  p.id = id;
+  p.mass = r.mass;
+  p.position = Vec2(r.x, r.y);
+  p.velocity = Vec2(r.vx, r.vy);
+  return p;
+}
+
+inline ParticleRecord toRecord(const Particle &p) {
+  return ParticleRecord{p.mass, p.position.x, p.position.y, p.velocity.x,
+                        p.velocity.y};
+}
+
+// Maps the file and converts the records in place of parsing them.
+inline bool loadFromBinaryFile(const std::string &fileName,
+                               std::vector<Particle> &particles) {
+  int fd = open(fileName.c_str(), O_RDONLY);
+  assert(fd >= 0 && "Cannot open input file");
+  struct stat st;
+  fstat(fd, &st);
+  assert((size_t)st.st_size >= sizeof(ParticleFileHeader) &&
+         "Truncated particle file");
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  assert(map != MAP_FAILED && "Cannot map input file");
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  const ParticleFileHeader *header = (const ParticleFileHeader *)map;
+  assert(isBinaryHeader(*header) && "Not a binary particle file");
+  assert(sizeof(ParticleFileHeader) + header->count * sizeof(ParticleRecord) <=
+             (size_t)st.st_size &&
+         "Truncated particle file");
+  const ParticleRecord *records = (const ParticleRecord *)(header + 1);
+  particles.resize(header->count);
+  for (size_t i = 0; i < particles.size(); i++)
+    particles[i] = fromRecord(records[i], (int)i);
+  munmap(map, st.st_size);
+  return true;
+}
+
+// Packs header and records into one buffer and writes it with one call.
+inline void saveToBinaryFile(const std::string &fileName,
+                             const std::vector<Particle> &particles) {
+  std::vector<char> buf(sizeof(ParticleFileHeader) +
+                        particles.size() * sizeof(ParticleRecord));
+  ParticleFileHeader *header = (ParticleFileHeader *)buf.data();
+  memcpy(header->magic, ParticleFileMagic, 4);
+  header->version = ParticleFileVersion;
+  header->count = particles.size();
+  ParticleRecord *records = (ParticleRecord *)(header + 1);
+  for (size_t i = 0; i < particles.size(); i++)
+    records[i] = toRecord(particles[i]);
+
+  std::ofstream f(fileName, std::ios::binary);
+  assert((bool)f && "Cannot open output file");
+  f.write(buf.data(), buf.size());
+  assert((bool)f && "Failed to write to output file");
+}
+
+// pwrite()s bytes of data at offset, retrying short writes.
+inline void writeFully(int fd, const void *data, size_t bytes, off_t offset) {
+  const char *p = (const char *)data;
+  while (bytes > 0) {
+    ssize_t written = pwrite(fd, p, bytes, offset);
+    assert(written > 0 && "Failed to write to particle file");
+    if (written <= 0)
+      return;
+    p += written;
+    bytes -= written;
+    offset += written;
+  }
+}
+
+// Writes the header of a binary file of count particles to fd and sizes the
+// file for them, dropping the tail of an older, longer file.
+inline void writeBinaryHeader(int fd, long long count) {
+  ParticleFileHeader header;
+  memcpy(header.magic, ParticleFileMagic, 4);
+  header.version = ParticleFileVersion;
+  header.count = count;
+  writeFully(fd, &header, sizeof(header), 0);
+  int err = ftruncate(fd, sizeof(header) + count * sizeof(ParticleRecord));
+  assert(err == 0 && "Cannot size particle file");
+  (void)err;
+}
+
+// Writes the n particles, sorted by id, to their records in the binary file
+// fd, one pwrite per run of consecutive ids, so that writers of disjoint id
+// sets can share a file. records is scratch space.
+inline void writeRecordsById(int fd, const Particle *sorted, size_t n,
+                             std::vector<ParticleRecord> &records) {
+  records.resize(n);
+  for (size_t i = 0; i < n; i++)
+    records[i] = toRecord(sorted[i]);
+  for (size_t b = 0, e; b < n; b = e) {
+    for (e = b + 1; e < n; e++)
+      if (sorted[e].id != sorted[e - 1].id + 1)
+        break;
+    writeFully(fd, &records[b], (e - b) * sizeof(ParticleRecord),
+               sizeof(ParticleFileHeader) +
+                   (off_t)sorted[b].id * sizeof(ParticleRecord));
+  }
+}
+
+// loadFromFile for either format, told apart by the header.
+inline bool loadParticles(const std::string &fileName,
+                          std::vector<Particle> &particles) {
+  if (isBinaryParticleFile(fileName))
+    return loadFromBinaryFile(fileName, particles);
+  return loadFromFile(fileName, particles);
+}
+
+// Output files ending in ".bin" are written in the binary format, others as
+// text for checker.py.
+inline bool isBinaryFileName(const std::string &fileName) {
+  return fileName.size() >= 4 &&
+         fileName.compare(fileName.size() - 4, 4, ".bin") == 0;
+}
+
+inline void saveParticles(const std::string &fileName,
+                          const std::vector<Particle> &particles) {
+  if (isBinaryFileName(fileName))
+    saveToBinaryFile(fileName, particles);
+  else
+    saveToFile(fileName, particles);
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "mpi.h"
+#include "timing.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Phases of the simulators' main loops. Not every simulator has every phase.
+enum class Phase {
+  Redistribute, // domain decomposition and particle migration (v2)
+  Build,        // spatial index builds
+  Exchange,     // particle / bounds exchange and halo packing
+  Force,        // force accumulation
+  Integrate,    // updateParticle
+  Wait,         // blocking on outstanding messages
+  Count
+};
+
+enum class Counter {
+  NeighborsVisited, // attractors evaluated by the force kernels
+  BytesSent,        // particle payload handed to MPI
+  ParticlesMigrated,
+  TreeRebuilds,     // full tree builds, counted with -refit and -verlet
+  Allocations,      // heap allocations after the warm-up iterations
+  ForceEvaluations, // targets whose force was evaluated
+  RedoneSteps,      // steps of failed -block blocks, run again one by one
+  Count
+};
+
+// Per-rank phase timer and event counters, enabled with -profile. Times are
+// kept per iteration; report() reduces the per-rank totals to min / mean /
+// max and prints them with the max / mean imbalance. A disabled profiler
+// only tests a flag, so the calls can stay in the main loops; a timed one
+// keeps the phase times for seconds() without counting or reporting.
+class PhaseProfiler {
+public:
+  static constexpr int NumPhases = (int)Phase::Count;
+  static constexpr int NumCounters = (int)Counter::Count;
+
+  // numIterations reserves the per-iteration records up front, so profiling
+  // does not allocate inside the measured loop
+  PhaseProfiler(bool enabled, int numIterations = 0, bool timed = false)
+      : enabled(enabled), timed(enabled || timed) {
+    if (this->timed)
+      iterations.reserve(numIterations);
+  }
+
+  bool isEnabled() const { return enabled; }
+
+  // times the enclosing block as phase
+  class Scope {
+  public:
+    Scope(PhaseProfiler &profiler, Phase phase)
+        : profiler(profiler), phase(phase) {
+      profiler.begin(phase);
+    }
+    ~Scope() { profiler.end(phase); }
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+  private:
+    PhaseProfiler &profiler;
+    Phase phase;
+  };
+
+  void begin(Phase phase) {
+    if (!timed)
+      return;
+    started[(int)phase] = timer.elapsed();
+  }
+
+  void end(Phase phase) {
+    if (!timed)
+      return;
+    current()[(int)phase] += timer.elapsed() - started[(int)phase];
+  }
+
+  void count(Counter counter, double amount) {
+    if (enabled)
+      counters[(int)counter] += amount;
+  }
+
+  // starts the record of the next iteration
+  void nextIteration() {
+    if (timed)
+      iterations.emplace_back();
+  }
+
+  // seconds this rank spent in phase over the iterations [first, last)
+  double seconds(Phase phase, int first, int last) const {
+    double total = 0.0;
+    for (int i = first; i < last && i < (int)iterations.size(); i++)
+      total += iterations[i].seconds[(int)phase];
+    return total;
+  }
+
+  // Collective over comm. Prints the summary on rank 0 and, if csvFile is
+  // set, writes every rank's per-iteration phase times to it as
+  // "iteration,rank,phase,seconds" rows.
+  void report(MPI_Comm comm, const std::string &csvFile) const {
+    if (!enabled)
+      return;
+    int pid, nproc;
+    MPI_Comm_rank(comm, &pid);
+    MPI_Comm_size(comm, &nproc);
+
+    double values[NumPhases + NumCounters] = {0.0};
+    for (auto &it : iterations)
+      for (int p = 0; p < NumPhases; p++)
+        values[p] += it.seconds[p];
+    for (int c = 0; c < NumCounters; c++)
+      values[NumPhases + c] = counters[c];
+    const int n = NumPhases + NumCounters;
+    double lo[n], hi[n], sum[n];
+    MPI_Reduce(values, lo, n, MPI_DOUBLE, MPI_MIN, 0, comm);
+    MPI_Reduce(values, hi, n, MPI_DOUBLE, MPI_MAX, 0, comm);
+    MPI_Reduce(values, sum, n, MPI_DOUBLE, MPI_SUM, 0, comm);
+    if (pid == 0) {
+      printf("%-18s %12s %12s %12s %9s\n", "profile", "min", "mean", "max",
+             "max/mean");
+      for (int k = 0; k < n; k++) {
+        double mean = sum[k] / nproc;
+        printf("%-18s %12.6g %12.6g %12.6g %9.3f\n", name(k), lo[k], mean,
+               hi[k], mean > 0.0 ? hi[k] / mean : 1.0);
+      }
+    }
+
+    if (csvFile.empty())
+      return;
+    std::vector<Iteration> all(pid == 0 ? iterations.size() * nproc : 0);
+    const int bytes = (int)(iterations.size() * sizeof(Iteration));
+    MPI_Gather(iterations.data(), bytes, MPI_BYTE, all.data(), bytes,
+               MPI_BYTE, 0, comm);
+    if (pid != 0)
+      return;
+    FILE *f = fopen(csvFile.c_str(), "w");
+    if (!f)
+      return;
+    fprintf(f, "iteration,rank,phase,seconds\n");
+    for (int r = 0; r < nproc; r++)
+      for (size_t i = 0; i < iterations.size(); i++)
+        for (int p = 0; p < NumPhases; p++)
+          fprintf(f, "%zu,%d,%s,%.9f\n", i, r, name(p),
+                  all[r * iterations.size() + i].seconds[p]);
+    fclose(f);
+  }
+
+private:
+  struct Iteration {
+    double seconds[NumPhases] = {0.0};
+  };
+
+  bool enabled, timed;
+  Timer timer;
+  double started[NumPhases] = {0.0};
+  double counters[NumCounters] = {0.0};
+  std::vector<Iteration> iterations;
+
+  double *current() {
+    if (iterations.empty())
+      iterations.emplace_back();
+    return iterations.back().seconds;
+  }
+
+  // phases first, then counters
+  static const char *name(int k) {
+    static const char *names[] = {"redistribute", "build",     "exchange",
+                                  "force",        "integrate", "wait",
+                                  "neighbors",    "bytes_sent", "migrated",
+                                  "rebuilds",     "allocations",
+                                  "evaluations",  "redone"};
+    return names[k];
+  }
+};
+
+#endif
@@ -1,10 +1,20 @@
 #ifndef QUAD_TREE_H
 #define QUAD_TREE_H
 
+#include "arena.h"
 #include "common.h"
+#include "morton.h"
+#include "thread-pool.h"
+#include <algorithm>
 #include <memory>
 
 const int QuadTreeLeafSize = 128;
+// extra elements at the end of the SoA arrays so vector kernels can load
+// whole registers past the last particle
+const int QuadTreeSoAPadding = 16;
+// QuadTree::refit gives up once the leaves' summed width + height has grown
+// by this factor since the last full build
+const float QuadTreeRefitLimit = 1.25f;
 
 // NOTE: Do not remove or edit funcations and variables in this class definition
 class QuadTreeNode {
@@ -26,120 +36,620 @@ public:
   std::vector<Particle> particles;
 };
 
+// Node of the flat tree built by QuadTree::buildQuadTree. All nodes of a tree
+// live in one pool (QuadTree::nodes). The four children of an interior node are
+// stored contiguously starting at firstChild, in the same order as
+// QuadTreeNode::children. Every node covers the contiguous range [begin, end)
+// of QuadTree::leafParticles, and bmin/bmax contain all of its particles.
+struct FlatQuadTreeNode {
+  Vec2 bmin, bmax;
+  int firstChild = -1; // -1 for leaves
+  int begin = 0, end = 0;
+
+  bool isLeaf() const { return firstChild < 0; }
+  int size() const { return end - begin; }
+};
+
 inline float boxPointDistance(Vec2 bmin, Vec2 bmax, Vec2 p) {
   float dx = fmaxf(fmaxf(bmin.x - p.x, p.x - bmax.x), 0.0f);
   float dy = fmaxf(fmaxf(bmin.y - p.y, p.y - bmax.y), 0.0f);
   return sqrt(dx * dx + dy * dy);
 }
 
+inline float boxBoxDistance(Vec2 amin, Vec2 amax, Vec2 bmin, Vec2 bmax) {
+  float dx = fmaxf(fmaxf(amin.x - bmax.x, bmin.x - amax.x), 0.0f);
+  float dy = fmaxf(fmaxf(amin.y - bmax.y, bmin.y - amax.y), 0.0f);
+  return sqrt(dx * dx + dy * dy);
+}
+
+// distance from p to the farthest point of the box
+inline float boxPointMaxDistance(Vec2 bmin, Vec2 bmax, Vec2 p) {
+  float dx = fmaxf(p.x - bmin.x, bmax.x - p.x);
+  float dy = fmaxf(p.y - bmin.y, bmax.y - p.y);
+  return sqrt(dx * dx + dy * dy);
+}
+
 // NOTE: Do not remove or edit funcations and variables in this class definition
 class QuadTree {
 public:
+  // unused by the flat build below, kept for interface compatibility
   std::unique_ptr<QuadTreeNode> root = nullptr;
   // the bounds of all particles
   Vec2 bmin, bmax;
 
+  // node pool, nodes[0] is the root
+  std::vector<FlatQuadTreeNode> nodes;
+  // copy of the input particles, partitioned so that every node covers a
+  // contiguous range
+  std::vector<Particle> leafParticles;
+  // positions and masses of leafParticles as structure of arrays, padded by
+  // QuadTreeSoAPadding zeros
+  std::vector<float> leafX, leafY, leafMass;
+  // total mass and center of mass of every node's particles, indexed like
+  // nodes; only filled in by summarize()
+  std::vector<float> nodeMass;
+  std::vector<Vec2> nodeCenterOfMass;
+
   void getParticles(std::vector<Particle> &particles, Vec2 position,
                     float radius) const {
     particles.clear();
-    getParticlesImpl(particles, root.get(), bmin, bmax, position, radius);
+    if (nodes.empty())
+      return;
+    getParticlesImpl(particles, 0, position, radius);
   }
 
+  // Calls f(const Particle &) for every particle within radius of position,
+  // directly on leaf storage, visiting the same particles as getParticles.
+  template <typename F>
+  void forEachNeighbor(Vec2 position, float radius, F &&f) const {
+    forEachLeaf(position, radius,
+                [&](const FlatQuadTreeNode &leaf, bool inside) {
+                  const Particle *ps = leafParticles.data();
+                  if (inside) {
+                    for (int i = leaf.begin; i < leaf.end; i++)
+                      f(ps[i]);
+                    return;
+                  }
+                  for (int i = leaf.begin; i < leaf.end; i++)
+                    if ((position - ps[i].position).length() < radius)
+                      f(ps[i]);
+                });
+  }
+
+  // Calls f(const FlatQuadTreeNode &leaf, bool inside) for every non-empty
+  // leaf whose bounds come within radius of position. inside is set when the
+  // whole leaf lies within radius, so the caller can skip per-particle
+  // distance tests.
+  template <typename F>
+  void forEachLeaf(Vec2 position, float radius, F &&f) const {
+    if (nodes.empty())
+      return;
+    forEachLeafImpl(0, position, radius, f);
+  }
+
+  // Calls f(int leafIndex) for every non-empty leaf whose bounds come within
+  // radius of the box (bmin, bmax). The test is symmetric, so leaf b is
+  // reported for the bounds of leaf a exactly when a is for those of b.
+  template <typename F>
+  void forEachLeafNearBox(Vec2 bmin, Vec2 bmax, float radius, F &&f) const {
+    if (nodes.empty())
+      return;
+    forEachLeafNearBoxImpl(0, bmin, bmax, radius, f);
+  }
+
+  // Builds the tree in place: the particles are copied once and then
+  // partitioned level by level between leafParticles and a scratch buffer.
+  // Reusing the same QuadTree object across iterations reuses all buffers.
   static void buildQuadTree(const std::vector<Particle> &particles,
                             QuadTree &tree) {
     // find bounds
-    Vec2 bmin(1e30f, 1e30f);
-    Vec2 bmax(-1e30f, -1e30f);
+    Vec2 bmin, bmax;
+    findBounds(particles.data(), particles.data() + particles.size(), bmin,
+               bmax);
+
+    // build nodes
+    tree.bmin = bmin;
+    tree.bmax = bmax;
+
+    tree.initRoot(particles);
+    tree.buildQuadTreeImpl(tree.nodes, 0, false);
+    tree.fillSoA();
+  }
+
+  // Same tree as above, built by the threads of pool: the top levels are
+  // split serially, then every subtree below them is built as one task into
+  // the node pool of the worker running it, and the subtrees are spliced
+  // together at the end.
+  static void buildQuadTree(const std::vector<Particle> &particles,
+                            QuadTree &tree, ThreadPool &pool) {
+    if (pool.size() == 1) {
+      buildQuadTree(particles, tree);
+      return;
+    }
+    Vec2 bmin, bmax;
+    findBounds(particles.data(), particles.data() + particles.size(), bmin,
+               bmax);
+    tree.bmin = bmin;
+    tree.bmax = bmax;
+    tree.initRoot(particles);
 
-    for (auto &p : particles) {
-      bmin.x = fminf(bmin.x, p.position.x);
-      bmin.y = fminf(bmin.y, p.position.y);
-      bmax.x = fmaxf(bmax.x, p.position.x);
-      bmax.y = fmaxf(bmax.y, p.position.y);
+    // enough subtrees for the workers to balance uneven subtree sizes
+    auto &front = tree.buildFront, &next = tree.buildFrontNext;
+    // a front below 4 tasks per worker splits into at most 16 per worker
+    front.reserve(16 * pool.size());
+    next.reserve(16 * pool.size());
+    front.assign(1, BuildTask{0, false});
+    while (!front.empty() && front.size() < (size_t)pool.size() * 4) {
+      next.clear();
+      for (auto task : front) {
+        if (!tree.splitNode(tree.nodes, task.node, task.inScratch))
+          continue;
+        for (int c = 0; c < 4; c++)
+          next.push_back(
+              BuildTask{tree.nodes[task.node].firstChild + c, !task.inScratch});
+      }
+      front.swap(next);
     }
 
-    // build nodes
+    // every worker appends the subtrees it builds to its own node pool. With
+    // work stealing any worker may end up building most of the tree, so
+    // each pool gets the capacity of the shared one, which only grows when
+    // the tree does
+    auto &pools = tree.workerPools;
+    auto &ranges = tree.subtreeRanges;
+    pools.resize(pool.size());
+    for (auto &nodes : pools) {
+      nodes.clear();
+      nodes.reserve(tree.nodes.capacity());
+    }
+    ranges.resize(front.size());
+    pool.parallelFor(0, front.size(), 1, [&](size_t b, size_t e, int w) {
+      auto &nodes = pools[w];
+      for (size_t t = b; t < e; t++) {
+        const int root = (int)nodes.size();
+        nodes.push_back(tree.nodes[front[t].node]);
+        tree.buildQuadTreeImpl(nodes, root, front[t].inScratch);
+        ranges[t] = SubtreeRange{w, root, (int)nodes.size()};
+      }
+    });
+
+    // node k > root of a subtree lands at base + k in the shared pool
+    size_t total = tree.nodes.size();
+    for (const auto &r : ranges)
+      total += r.end - r.root - 1;
+    reserveWithSlack(tree.nodes, total);
+    for (size_t t = 0; t < front.size(); t++) {
+      const SubtreeRange r = ranges[t];
+      const auto &sub = pools[r.worker];
+      const int base = (int)tree.nodes.size() - 1 - r.root;
+      tree.nodes[front[t].node].firstChild =
+          sub[r.root].isLeaf() ? -1 : sub[r.root].firstChild + base;
+      for (int k = r.root + 1; k < r.end; k++) {
+        FlatQuadTreeNode node = sub[k];
+        if (!node.isLeaf())
+          node.firstChild += base;
+        tree.nodes.push_back(node);
+      }
+    }
+    tree.fillSoA(pool);
+  }
+
+  // Builds a linear quadtree instead: the particles are radix sorted by
+  // Morton key over (bmin, bmax), and each node's children are found by
+  // binary search on the sorted keys. leafParticles ends up in Z-curve order.
+  // Node bounds are the tight bounds of the node's particles and leaves stop
+  // splitting at the key resolution, MortonBitsPerAxis levels deep.
+  static void buildQuadTreeMorton(const std::vector<Particle> &particles,
+                                  QuadTree &tree) {
+    Vec2 bmin, bmax;
+    findBounds(particles.data(), particles.data() + particles.size(), bmin,
+               bmax);
     tree.bmin = bmin;
     tree.bmax = bmax;
 
-    tree.root = buildQuadTreeImpl(particles, bmin, bmax);
+    tree.morton.sort(particles, bmin, bmax);
+    tree.morton.gather(particles, tree.leafParticles);
+    tree.refitReady = false;
+    tree.nodes.clear();
+    tree.nodes.emplace_back();
+    tree.buildLinearQuadTreeImpl(0, 0, (int)particles.size(), 0);
+    tree.fillSoA();
   }
 
-private:
-  static std::unique_ptr<QuadTreeNode>
-  buildQuadTreeImpl(const std::vector<Particle> &particles, Vec2 bmin,
-                    Vec2 bmax) {
-    std::unique_ptr<QuadTreeNode> quad_node = std::make_unique<QuadTreeNode>();
-    
-    std::vector<Particle> top_left;
-    std::vector<Particle> top_right;
-    std::vector<Particle> bottom_left;
-    std::vector<Particle> bottom_right;
-
-    int count = 0;
+  // Computes every node's total mass and center of mass for Barnes-Hut
+  // evaluation, see accumulateTreeForceBarnesHut. Works after any of the
+  // builds: children always come after their parent in the pool, so one
+  // backwards pass sees every child before its parent.
+  void summarize() {
+    // grow with the node pool, not with every new node count
+    nodeMass.reserve(nodes.capacity());
+    nodeCenterOfMass.reserve(nodes.capacity());
+    nodeMass.resize(nodes.size());
+    nodeCenterOfMass.resize(nodes.size());
+    for (int n = (int)nodes.size() - 1; n >= 0; n--) {
+      const FlatQuadTreeNode &node = nodes[n];
+      float mass = 0.0f;
+      Vec2 weighted(0.0f, 0.0f);
+      if (node.isLeaf()) {
+        for (int i = node.begin; i < node.end; i++) {
+          mass += leafParticles[i].mass;
+          weighted += leafParticles[i].position * leafParticles[i].mass;
+        }
+      } else {
+        for (int c = node.firstChild; c < node.firstChild + 4; c++) {
+          mass += nodeMass[c];
+          weighted += nodeCenterOfMass[c] * nodeMass[c];
+        }
+      }
+      nodeMass[n] = mass;
+      nodeCenterOfMass[n] = mass > 0.0f ? weighted * (1.0f / mass)
+                                        : (node.bmin + node.bmax) * 0.5f;
+    }
+  }
+
+  // Moves the tree to a later state of the particles it was last built from
+  // without rebuilding it: every particle is written back into its old leaf
+  // slot and node bounds are refit bottom-up to the tight bounds of their
+  // particles. Leaves keep their particles, so their bounds grow and overlap
+  // as particles drift; once the summed leaf extent exceeds
+  // QuadTreeRefitLimit times that of the built tree, or the particles are not
+  // the same ids in the same order as at the last refit, refit returns false
+  // and the caller must rebuild. Node summaries are not updated, call
+  // summarize() again.
+  bool refit(const std::vector<Particle> &particles) {
+    const int n = (int)particles.size();
+    if (nodes.empty() || n != (int)leafParticles.size())
+      return false;
+    if (refitSkip > 0) {
+      refitSkip--;
+      return false;
+    }
+    if (!refitReady) {
+      // first refit since the build: find every slot's particle by id and
+      // measure the tree
+      int maxId = -1;
+      for (auto &p : particles)
+        maxId = std::max(maxId, p.id);
+      reserveWithSlack(sourceIndex, maxId + 1);
+      reserveWithSlack(leafSource, n);
+      sourceIndex.assign(maxId + 1, -1);
+      leafSource.resize(n);
+      for (int i = 0; i < n; i++)
+        if (particles[i].id >= 0)
+          sourceIndex[particles[i].id] = i;
+      for (int k = 0; k < n; k++) {
+        const int id = leafParticles[k].id;
+        leafSource[k] = id >= 0 && id <= maxId ? sourceIndex[id] : -1;
+        if (leafSource[k] < 0)
+          return refitFailed();
+      }
+      refitBaseline = refitBounds();
+      refitReady = true;
+      refitFirst = true;
+    }
+    // ids are unique, so matching every slot's id checks the whole set
+    for (int k = 0; k < n; k++) {
+      const Particle &p = particles[leafSource[k]];
+      if (p.id != leafParticles[k].id)
+        return refitFailed();
+      leafParticles[k] = p;
+    }
+    if (refitBounds() > QuadTreeRefitLimit * refitBaseline)
+      return refitFailed();
+    refitFirst = false;
+    refitBackoff = 0;
+    bmin = nodes[0].bmin;
+    bmax = nodes[0].bmax;
+    return true;
+  }
+
+  // Building blocks for trees assembled from subtrees built elsewhere, see
+  // distributed-tree.h.
+
+  // Builds the subtrees rooted at nodes[0, numRoots). Each root's bounds and
+  // range must be set, the ranges must not overlap, and leafParticles must
+  // already hold the particles of every range.
+  void buildForest(int numRoots) {
+    reserveWithSlack(scratch, leafParticles.size());
+    scratch.resize(leafParticles.size());
+    refitReady = false;
+    for (int r = 0; r < numRoots; r++)
+      buildQuadTreeImpl(nodes, r, false);
+  }
+
+  // Recomputes the SoA arrays after nodes and leafParticles were filled in
+  // directly.
+  void refreshSoA() { fillSoA(); }
+
+  // index of the child quadrant of a point, see QuadTreeNode::children
+  static int quadrant(Vec2 p, float x_split, float y_split) {
+    return (p.x > x_split ? 1 : 0) | (p.y > y_split ? 2 : 0);
+  }
+
+  // bounds of child quadrant c of the box (bmin, bmax), split at its center
+  // exactly like buildQuadTree does
+  static void childBounds(Vec2 bmin, Vec2 bmax, int c, Vec2 &childMin,
+                          Vec2 &childMax) {
     const float x_split = (bmin.x + bmax.x) / 2;
     const float y_split = (bmin.y + bmax.y) / 2;
+    childMin.x = (c & 1) ? x_split : bmin.x;
+    childMax.x = (c & 1) ? bmax.x : x_split;
+    childMin.y = (c & 2) ? y_split : bmin.y;
+    childMax.y = (c & 2) ? bmax.y : y_split;
+  }
+
+private:
+  struct BuildTask {
+    int node;
+    bool inScratch;
+  };
+  // nodes [root, end) of a worker pool, root a copy of a front node
+  struct SubtreeRange {
+    int worker, root, end;
+  };
+
+  std::vector<Particle> scratch;
+  MortonSorter morton;
+  std::vector<BuildTask> buildFront, buildFrontNext;
+  std::vector<std::vector<FlatQuadTreeNode>> workerPools;
+  std::vector<SubtreeRange> subtreeRanges;
+  // refit state, see refit(); reset by every build
+  bool refitReady = false, refitFirst = false;
+  float refitBaseline = 0.0f;
+  // refit attempts left to skip, and how many to skip after the next
+  // immediate failure
+  int refitSkip = 0, refitBackoff = 0;
+  // leafSource[k]: index of leafParticles[k] in refit's input, found by id
+  std::vector<int> leafSource, sourceIndex;
+
+  // When particles move too fast for even one refit, the attempts are wasted
+  // work on top of the rebuilds, so back off exponentially.
+  bool refitFailed() {
+    if (refitFirst) {
+      refitBackoff = std::min(std::max(2 * refitBackoff, 1), 16);
+      refitSkip = refitBackoff;
+    }
+    refitReady = false;
+    return false;
+  }
+
+  // copies the particles and sets up the root node over the tree bounds
+  void initRoot(const std::vector<Particle> &particles) {
+    reserveWithSlack(leafParticles, particles.size());
+    reserveWithSlack(scratch, particles.size());
+    leafParticles.assign(particles.begin(), particles.end());
+    scratch.resize(particles.size());
+    refitReady = false;
+    nodes.clear();
+    nodes.emplace_back();
+    nodes[0].bmin = bmin;
+    nodes[0].bmax = bmax;
+    nodes[0].begin = 0;
+    nodes[0].end = (int)particles.size();
+  }
+
+  void fillSoA() {
+    resizeSoA();
+    fillSoARange(0, leafParticles.size());
+  }
+
+  void fillSoA(ThreadPool &pool) {
+    resizeSoA();
+    pool.parallelFor(0, leafParticles.size(), 4096,
+                     [this](size_t b, size_t e, int) { fillSoARange(b, e); });
+  }
 
-    for (auto &p : particles) {
-      count ++;
-      if (p.position.x <= x_split && p.position.y <= y_split)
-        top_left.push_back(p);
-      else if (p.position.x > x_split && p.position.y <= y_split)
-        top_right.push_back(p);
-      else if (p.position.x <= x_split && p.position.y > y_split)
-        bottom_left.push_back(p);
-      else if (p.position.x > x_split && p.position.y > y_split)
-        bottom_right.push_back(p);
-    }
-    // printf("count %d, current boundary: %f, %f, %f, %f\n", count, bmin.x, bmin.y, bmax.x, bmax.y);
-    if (count <= QuadTreeLeafSize) {
-      quad_node->isLeaf = true;
-      for (auto &p : particles) {
-        quad_node->particles.push_back(p);
+  void resizeSoA() {
+    const size_t n = leafParticles.size();
+    reserveWithSlack(leafX, n + QuadTreeSoAPadding);
+    reserveWithSlack(leafY, n + QuadTreeSoAPadding);
+    reserveWithSlack(leafMass, n + QuadTreeSoAPadding);
+    leafX.resize(n + QuadTreeSoAPadding);
+    leafY.resize(n + QuadTreeSoAPadding);
+    leafMass.resize(n + QuadTreeSoAPadding);
+    std::fill(leafX.begin() + n, leafX.end(), 0.0f);
+    std::fill(leafY.begin() + n, leafY.end(), 0.0f);
+    std::fill(leafMass.begin() + n, leafMass.end(), 0.0f);
+  }
+
+  void fillSoARange(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      leafX[i] = leafParticles[i].position.x;
+      leafY[i] = leafParticles[i].position.y;
+      leafMass[i] = leafParticles[i].mass;
+    }
+  }
+
+  // Sets every node's bounds to the tight bounds of its particles (inverted
+  // for empty nodes, which no query reaches) and returns the summed width +
+  // height of the non-empty leaves. Refills the SoA arrays on the way.
+  float refitBounds() {
+    resizeSoA();
+    float extent = 0.0f;
+    for (int n = (int)nodes.size() - 1; n >= 0; n--) {
+      FlatQuadTreeNode &node = nodes[n];
+      if (node.isLeaf()) {
+        findBounds(leafParticles.data() + node.begin,
+                   leafParticles.data() + node.end, node.bmin, node.bmax);
+        fillSoARange(node.begin, node.end);
+        if (node.size() > 0)
+          extent += (node.bmax.x - node.bmin.x) + (node.bmax.y - node.bmin.y);
+        continue;
+      }
+      node.bmin = Vec2(1e30f, 1e30f);
+      node.bmax = Vec2(-1e30f, -1e30f);
+      for (int c = node.firstChild; c < node.firstChild + 4; c++) {
+        node.bmin.x = fminf(node.bmin.x, nodes[c].bmin.x);
+        node.bmin.y = fminf(node.bmin.y, nodes[c].bmin.y);
+        node.bmax.x = fmaxf(node.bmax.x, nodes[c].bmax.x);
+        node.bmax.y = fmaxf(node.bmax.y, nodes[c].bmax.y);
       }
-    } else {
-      quad_node -> isLeaf = false;
-      Vec2 bmin_new(bmin.x, bmin.y);
-      Vec2 bmax_new(x_split, y_split);
-      quad_node->children[0] = buildQuadTreeImpl(top_left, bmin_new, bmax_new);
+    }
+    return extent;
+  }
 
-      bmin_new.x = x_split;
-      bmax_new.x = bmax.x;
-      quad_node->children[1] = buildQuadTreeImpl(top_right, bmin_new, bmax_new);
+  static void findBounds(const Particle *begin, const Particle *end,
+                         Vec2 &bmin, Vec2 &bmax) {
+    bmin = Vec2(1e30f, 1e30f);
+    bmax = Vec2(-1e30f, -1e30f);
+    for (const Particle *p = begin; p != end; p++) {
+      bmin.x = fminf(bmin.x, p->position.x);
+      bmin.y = fminf(bmin.y, p->position.y);
+      bmax.x = fmaxf(bmax.x, p->position.x);
+      bmax.y = fmaxf(bmax.y, p->position.y);
+    }
+  }
 
-      bmin_new.x = bmin.x;
-      bmin_new.y = y_split;
-      bmax_new.x = x_split;
-      bmax_new.y = bmax.y;
-      quad_node->children[2] = buildQuadTreeImpl(bottom_left, bmin_new, bmax_new);
+  void buildLinearQuadTreeImpl(int nodeIndex, int begin, int end, int level) {
+    nodes[nodeIndex].begin = begin;
+    nodes[nodeIndex].end = end;
+    nodes[nodeIndex].firstChild = -1;
 
-      bmin_new.x = x_split;
-      bmax_new.x = bmax.x;
-      quad_node->children[3] = buildQuadTreeImpl(bottom_right, bmin_new, bmax_new);
+    if (end - begin <= QuadTreeLeafSize || level == MortonBitsPerAxis) {
+      findBounds(leafParticles.data() + begin, leafParticles.data() + end,
+                 nodes[nodeIndex].bmin, nodes[nodeIndex].bmax);
+      return;
     }
 
-    return quad_node;
+    // all keys in [begin, end) share their top 2 * level bits, so the next
+    // two bits are sorted and split the range into the four children
+    const int shift = 2 * (MortonBitsPerAxis - 1 - level);
+    const uint32_t *keys = morton.keys.data();
+    int split[5];
+    split[0] = begin;
+    split[4] = end;
+    for (int c = 1; c < 4; c++) {
+      const uint32_t digit = (uint32_t)c;
+      auto below = [=](uint32_t k) { return ((k >> shift) & 3u) < digit; };
+      split[c] = (int)(std::partition_point(keys + split[c - 1], keys + end,
+                                            below) -
+                       keys);
+    }
+
+    int firstChild = (int)nodes.size();
+    nodes.resize(firstChild + 4);
+    nodes[nodeIndex].firstChild = firstChild;
+
+    Vec2 bmin(1e30f, 1e30f);
+    Vec2 bmax(-1e30f, -1e30f);
+    for (int c = 0; c < 4; c++) {
+      buildLinearQuadTreeImpl(firstChild + c, split[c], split[c + 1],
+                              level + 1);
+      const FlatQuadTreeNode &child = nodes[firstChild + c];
+      bmin.x = fminf(bmin.x, child.bmin.x);
+      bmin.y = fminf(bmin.y, child.bmin.y);
+      bmax.x = fmaxf(bmax.x, child.bmax.x);
+      bmax.y = fmaxf(bmax.y, child.bmax.y);
+    }
+    nodes[nodeIndex].bmin = bmin;
+    nodes[nodeIndex].bmax = bmax;
+  }
+
+  // Splits node nodeIndex of pool into the four quadrants of its bounds.
+  // The node's range currently lives in scratch if inScratch is set and in
+  // leafParticles otherwise; the split is written to the other buffer, so
+  // each level costs one pass over its particles. The split is stable, so the
+  // order inside a leaf matches the input order. Returns false and leaves the
+  // range in leafParticles if the node is a leaf.
+  bool splitNode(std::vector<FlatQuadTreeNode> &pool, int nodeIndex,
+                 bool inScratch) {
+    const FlatQuadTreeNode node = pool[nodeIndex];
+    const int begin = node.begin, end = node.end;
+    Particle *src = inScratch ? scratch.data() : leafParticles.data();
+    Particle *dst = inScratch ? leafParticles.data() : scratch.data();
+
+    if (end - begin <= QuadTreeLeafSize) {
+      if (inScratch)
+        std::copy(src + begin, src + end, dst + begin);
+      return false;
+    }
+
+    const float x_split = (node.bmin.x + node.bmax.x) / 2;
+    const float y_split = (node.bmin.y + node.bmax.y) / 2;
+
+    int offsets[4] = {0, 0, 0, 0};
+    for (int i = begin; i < end; i++)
+      offsets[quadrant(src[i].position, x_split, y_split)]++;
+    int childBegin[4];
+    int acc = begin;
+    for (int c = 0; c < 4; c++) {
+      childBegin[c] = acc;
+      acc += offsets[c];
+      offsets[c] = childBegin[c];
+    }
+    for (int i = begin; i < end; i++)
+      dst[offsets[quadrant(src[i].position, x_split, y_split)]++] = src[i];
+
+    // children are appended to the pool, so take indices, not references
+    int firstChild = (int)pool.size();
+    pool.resize(firstChild + 4);
+    pool[nodeIndex].firstChild = firstChild;
+    for (int c = 0; c < 4; c++) {
+      FlatQuadTreeNode &child = pool[firstChild + c];
+      childBounds(node.bmin, node.bmax, c, child.bmin, child.bmax);
+      child.begin = childBegin[c];
+      child.end = offsets[c];
+      child.firstChild = -1;
+    }
+    return true;
+  }
+
+  void buildQuadTreeImpl(std::vector<FlatQuadTreeNode> &pool, int nodeIndex,
+                         bool inScratch) {
+    if (!splitNode(pool, nodeIndex, inScratch))
+      return;
+    int firstChild = pool[nodeIndex].firstChild;
+    for (int c = 0; c < 4; c++)
+      buildQuadTreeImpl(pool, firstChild + c, !inScratch);
+  }
+
+  template <typename F>
+  void forEachLeafImpl(int nodeIndex, Vec2 position, float radius,
+                       F &f) const {
+    const FlatQuadTreeNode &node = nodes[nodeIndex];
+    if (node.isLeaf()) {
+      if (node.size() > 0)
+        f(node, boxPointMaxDistance(node.bmin, node.bmax, position) < radius);
+      return;
+    }
+    for (int i = 0; i < 4; i++) {
+      const FlatQuadTreeNode &child = nodes[node.firstChild + i];
+      if (boxPointDistance(child.bmin, child.bmax, position) <= radius)
+        forEachLeafImpl(node.firstChild + i, position, radius, f);
+    }
   }
 
-  static void getParticlesImpl(std::vector<Particle> &particles,
-                               QuadTreeNode *node, Vec2 bmin, Vec2 bmax,
-                               Vec2 position, float radius) {
-    if (node->isLeaf) {
-      for (auto &p : node->particles)
+  template <typename F>
+  void forEachLeafNearBoxImpl(int nodeIndex, Vec2 bmin, Vec2 bmax,
+                              float radius, F &f) const {
+    const FlatQuadTreeNode &node = nodes[nodeIndex];
+    if (node.isLeaf()) {
+      if (node.size() > 0)
+        f(nodeIndex);
+      return;
+    }
+    for (int i = 0; i < 4; i++) {
+      const FlatQuadTreeNode &child = nodes[node.firstChild + i];
+      if (boxBoxDistance(child.bmin, child.bmax, bmin, bmax) <= radius)
+        forEachLeafNearBoxImpl(node.firstChild + i, bmin, bmax, radius, f);
+    }
+  }
+
+  void getParticlesImpl(std::vector<Particle> &particles, int nodeIndex,
+                        Vec2 position, float radius) const {
+    const FlatQuadTreeNode &node = nodes[nodeIndex];
+    if (node.isLeaf()) {
+      for (int i = node.begin; i < node.end; i++) {
+        const Particle &p = leafParticles[i];
         if ((position - p.position).length() < radius)
           particles.push_back(p);
+      }
       return;
     }
-    Vec2 pivot = (bmin + bmax) * 0.5f;
-    Vec2 size = (bmax - bmin) * 0.5f;
     for (int i = 0; i < 4; i++) {
-      Vec2 childBMin;
-      childBMin.x = (i & 1) ? pivot.x : bmin.x;
-      childBMin.y = ((i >> 1) & 1) ? pivot.y : bmin.y;
-      Vec2 childBMax = childBMin + size;
-      if (boxPointDistance(childBMin, childBMax, position) <= radius)
-        getParticlesImpl(particles, node->children[i].get(), childBMin,
-                         childBMax, position, radius);
+      const FlatQuadTreeNode &child = nodes[node.firstChild + i];
+      if (boxPointDistance(child.bmin, child.bmax, position) <= radius)
+        getParticlesImpl(particles, node.firstChild + i, position, radius);
     }
   }
 };
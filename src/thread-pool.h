@@ -0,0 +1,148 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool for the threads of one MPI rank. The calling thread is
+// worker 0 and takes part in every parallelFor, so a pool of size 1 runs
+// everything inline and starts no threads. Only the calling thread may make
+// MPI calls (MPI_THREAD_FUNNELED).
+class ThreadPool {
+public:
+  explicit ThreadPool(int numThreads)
+      : queues(std::max(numThreads, 1)) {
+    for (int w = 1; w < size(); w++)
+      workers.emplace_back([this, w] { workerLoop(w); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto &t : workers)
+      t.join();
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  int size() const { return (int)queues.size(); }
+
+  // Calls fn(chunkBegin, chunkEnd, worker) over [begin, end) split into
+  // chunks of grain elements and returns once all chunks are done. Each
+  // worker starts on its own contiguous block of chunks and steals single
+  // chunks from the back of other workers' blocks once its own runs out.
+  template <typename F>
+  void parallelFor(size_t begin, size_t end, size_t grain, F &&fn) {
+    if (end <= begin)
+      return;
+    grain = std::max(grain, (size_t)1);
+    const size_t numChunks = (end - begin + grain - 1) / grain;
+    if (size() == 1 || numChunks == 1) {
+      fn(begin, end, 0);
+      return;
+    }
+
+    // publish the job before any chunk becomes visible in a queue
+    job = [&fn](size_t b, size_t e, int w) { fn(b, e, w); };
+    jobBegin = begin;
+    jobEnd = end;
+    jobGrain = grain;
+    remaining.store(numChunks);
+    const size_t perWorker = numChunks / size(), extra = numChunks % size();
+    size_t next = 0;
+    for (int w = 0; w < size(); w++) {
+      size_t count = perWorker + ((size_t)w < extra ? 1 : 0);
+      std::lock_guard<std::mutex> lock(queues[w].mutex);
+      queues[w].head = next;
+      queues[w].tail = next + count;
+      next += count;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      generation++;
+    }
+    wake.notify_all();
+
+    runChunks(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return remaining.load() == 0; });
+  }
+
+private:
+  // chunk indices [head, tail) not yet started; the owner pops from head,
+  // thieves from tail
+  struct ChunkQueue {
+    std::mutex mutex;
+    size_t head = 0, tail = 0;
+  };
+
+  std::vector<ChunkQueue> queues;
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  size_t generation = 0;
+  bool stop = false;
+
+  std::function<void(size_t, size_t, int)> job;
+  size_t jobBegin = 0, jobEnd = 0, jobGrain = 1;
+  std::atomic<size_t> remaining{0};
+
+  void workerLoop(int w) {
+    size_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return stop || generation != seen; });
+        if (stop)
+          return;
+        seen = generation;
+      }
+      runChunks(w);
+    }
+  }
+
+  bool popOwn(int w, size_t &chunk) {
+    ChunkQueue &q = queues[w];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.head == q.tail)
+      return false;
+    chunk = q.head++;
+    return true;
+  }
+
+  bool steal(int w, size_t &chunk) {
+    for (int i = 1; i < size(); i++) {
+      ChunkQueue &q = queues[(w + i) % size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (q.head != q.tail) {
+        chunk = --q.tail;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void runChunks(int w) {
+    size_t chunk;
+    while (popOwn(w, chunk) || steal(w, chunk)) {
+      size_t b = jobBegin + chunk * jobGrain;
+      job(b, std::min(b + jobGrain, jobEnd), w);
+      if (remaining.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.notify_all();
+      }
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef WIRE_FORMAT_H
+#define WIRE_FORMAT_H
+
+#include "common.h"
+#include "mpi.h"
+#include <cstddef>
+
+// Message formats for particles. Migrations carry the full Particle; ghosts
+// only feed force evaluation and need no more than position and mass, and
+// v1's replicated copies of other ranks' particles only their positions,
+// since ids and masses never change after load.
+
+// -wire names, see StartupOptions::wireFormat
+enum class WireFormat {
+  Full,    // whole Particles as bytes
+  Compact, // position and mass (v1: position) through an MPI datatype
+};
+
+inline WireFormat parseWireFormat(const std::string &name) {
+  if (name == "full")
+    return WireFormat::Full;
+  return WireFormat::Compact;
+}
+
+// bytes on the wire per ghost
+inline int wireBytes(WireFormat format) {
+  if (format == WireFormat::Full)
+    return sizeof(Particle);
+  return sizeof(Vec2) + sizeof(float);
+}
+
+// The position (and with withMass the mass) of a Particle, with a
+// Particle's extent so that counts of it walk arrays of Particles: MPI
+// gathers the fields on send and scatters them on receive, leaving the other
+// fields of the receiving Particles alone. Free with MPI_Type_free.
+inline MPI_Datatype createParticleFieldsType(bool withMass) {
+  int lengths[2] = {2, 1};
+  MPI_Aint displs[2] = {offsetof(Particle, position),
+                        offsetof(Particle, mass)};
+  MPI_Datatype types[2] = {MPI_FLOAT, MPI_FLOAT};
+  MPI_Datatype fields, resized;
+  MPI_Type_create_struct(withMass ? 2 : 1, lengths, displs, types, &fields);
+  MPI_Type_create_resized(fields, 0, sizeof(Particle), &resized);
+  MPI_Type_free(&fields);
+  MPI_Type_commit(&resized);
+  return resized;
+}
+
+#endif